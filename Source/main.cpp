@@ -11,6 +11,23 @@
 // / Check: Undo when playing Black
 // / Stats => [White/Black] Stats .... Score = ####{relative to the Stats subject}
 // Castle: Still allows castle thru threatened square
+// Engine (Chess.c, in Chess-for-Console):
+//   BestMove () & BoardScore (): template on side to move & _Analysis so Analysis picks
+//     the instantiation once per search, not per node. Bench with a fixed position (nodes / sec)
+//   Staged move generation on GetPieceMoves (): previous best, captures & crownings, killers,
+//     then quiet moves only if no cut-off yet
+//   BestMove (): PVS with zero window re-searches, iterative deepening with aspiration windows,
+//     triangular PV table instead of just BestA [0] / BestB [0]
+//   Selective search: null move (not in pawn-only endings), late move reductions, check &
+//     single reply extensions. Then add their settings to the Chess Engine page
+//   BoardScore (): lazy evaluation: pass alpha / beta down from BestMove (), score material first &
+//     skip the AnalysisScoreMove / Attack passes when it's further outside than they could add (a
+//     margin from their weights). Count lazy leaves in the Move Stats, checked against full scores
+//   NNUE style evaluator as a 5th _Analysis: int16 accumulators updated in MovePiece () /
+//     UnmovePiece (), AVX2 / SSE4 / scalar kernels, weights file in ResourcePath, self-play trainer.
+//     Add "NNUE" to dlAnalysis only once the engine knows the mode
+//   Pawn hash keyed on a pawn-only Zobrist key: passed, isolated, doubled, backward & shield
+//     terms, for richer pawn scoring in Add Moves Extended / Defend
 //
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -18,8 +35,21 @@
 const char Revision [] = "1.81";
 
 #include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sched.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#endif
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 
 #include "../Widgets/Widgets.hpp"
 #include "../Widgets/WidgetsGrid.hpp"
@@ -30,11 +60,386 @@ const char Revision [] = "1.81";
 
 #include "../ConsoleApps/chess/Chess.c"
 
-void DebugAdd (const char* Message)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// TRACE
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Each thread role writes its own ring, so no locks: only one thread of a role runs at a time.
+// Names must be string literals, only the pointer is kept. TraceMarkText () copies other text
+
+enum _TraceThread {ttMain, ttPlay, ttAnalyse, ttMate, ttImport, ttCount};
+
+const char *TraceThreadNames [ttCount] = {"Main", "PC Play", "Analyse", "Mate Solver", "PGN Import"};
+
+const int TraceSize = 1 << 13;   // Events per ring, a power of 2
+const int64_t TraceIdleNS = 20000;   // Main loop calls shorter than this aren't worth a span
+
+struct _TraceEvent
+  {
+    const char *Name;
+    int64_t Start;    // ns since TraceOrigin
+    int64_t Length;   // ns, or -1 for a Mark
+    int Value;
+  };
+
+struct _TraceRing
+  {
+    _TraceEvent Events [TraceSize];
+    volatile uint32_t Count;   // Events ever added. The oldest are overwritten
+  };
+
+_TraceRing TraceRings [ttCount];
+thread_local int TraceThread = ttMain;
+bool TraceEnabled = true;
+std::chrono::steady_clock::time_point TraceOrigin = std::chrono::steady_clock::now ();
+
+int64_t TraceNS (void)
+  {
+    return std::chrono::duration_cast <std::chrono::nanoseconds> (std::chrono::steady_clock::now () - TraceOrigin).count ();
+  }
+
+void TraceAdd (const char *Name, int64_t Start, int64_t Length, int Value)
+  {
+    _TraceRing *r;
+    _TraceEvent *e;
+    //
+    if (TraceEnabled)
+      {
+        r = &TraceRings [TraceThread];
+        e = &r->Events [r->Count & (TraceSize - 1)];
+        e->Name = Name;
+        e->Start = Start;
+        e->Length = Length;
+        e->Value = Value;
+        __sync_synchronize ();   // Event complete before it's counted
+        r->Count++;
+      }
+  }
+
+// An instant event
+void TraceMark (const char *Name, int Value = 0)
+  {
+    if (TraceEnabled)
+      TraceAdd (Name, TraceNS (), -1, Value);
+  }
+
+const int TraceTextSize = 32;   // Copied names are cut to this, with the 0
+
+char TraceTexts [ttCount][TraceSize][TraceTextSize];   // A slot per event, so a copy lasts as long as its event
+
+// An instant event named by the start of Text. Quotes, backslashes & control characters become spaces, for the JSON
+void TraceMarkText (const char *Text, int Value = 0)
+  {
+    char *Name;
+    int i;
+    //
+    if (TraceEnabled)
+      {
+        Name = TraceTexts [TraceThread][TraceRings [TraceThread].Count & (TraceSize - 1)];
+        for (i = 0; i < TraceTextSize - 1 && Text [i]; i++)
+          Name [i] = Text [i] == '"' || Text [i] == '\\' || (unsigned char) Text [i] < ' ' ? ' ' : Text [i];
+        Name [i] = 0;
+        TraceAdd (Name, TraceNS (), -1, Value);
+      }
+  }
+
+// Times the rest of the enclosing scope, eg { _TraceSpan Span ("DrawCustom"); ...
+struct _TraceSpan
+  {
+    const char *Name;
+    int64_t Start;
+    int Value;
+    _TraceSpan (const char *Name_, int Value_ = 0)
+      {
+        Name = Name_;
+        Value = Value_;
+        Start = TraceEnabled ? TraceNS () : 0;
+      }
+    ~_TraceSpan ()
+      {
+        if (TraceEnabled)
+          TraceAdd (Name, Start, TraceNS () - Start, Value);
+      }
+  };
+
+// Write the rings as Chrome trace JSON (chrome://tracing, Perfetto). Events still being written may be skipped
+void TraceSave (char *Name, void *Parameter)
+  {
+    int f;   // file ID
+    char Line [200];
+    int t, n, Count;
+    _TraceEvent *e;
+    bool First;
+    //
+    f = FileOpen (Name, foWrite);
+    if (f < 0)
+      return;
+    FileWriteLine (f, (char *) "{\"traceEvents\":[");
+    First = true;
+    for (t = 0; t < ttCount; t++)
+      {
+        snprintf (Line, sizeof (Line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", First ? "" : ",", t, TraceThreadNames [t]);
+        FileWriteLine (f, Line);
+        First = false;
+        Count = TraceRings [t].Count;
+        for (n = Max (Count - TraceSize + 1, 0); n < Count; n++)   // Leave the slot that may be being overwritten
+          {
+            e = &TraceRings [t].Events [n & (TraceSize - 1)];
+            if (e->Length < 0)
+              snprintf (Line, sizeof (Line), ",{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%d}}",
+                        e->Name, t, e->Start / 1000.0, e->Value);
+            else
+              snprintf (Line, sizeof (Line), ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"value\":%d}}",
+                        e->Name, t, e->Start / 1000.0, e->Length / 1000.0, e->Value);
+            FileWriteLine (f, Line);
+          }
+      }
+    FileWriteLine (f, (char *) "]}");
+    FileClose (f);
+  }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// PERFORMANCE COUNTERS
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// CPU counters for the calling thread, via perf_event_open (Linux only). A count of -1 wasn't counted:
+// not Linux, no such counter on this CPU, or /proc/sys/kernel/perf_event_paranoid forbids it.
+// When the CPU has fewer counters than events the kernel takes turns: counts are scaled up by
+// time enabled / time running, so they're estimates then
+
+enum _PerfCounter {pcCycles, pcInstructions, pcBranchMisses, pcL1DMisses, pcLLCMisses, pcDTLBMisses, pcCount};
+
+const char *PerfNames [pcCount] = {"Cycles", "Instr", "Branch miss", "L1D miss", "LLC miss", "dTLB miss"};
+
+struct _Perf
+  {
+    int Fd [pcCount];
+    int64_t Count [pcCount];
+  };
+
+bool PerfEnabled;   // Show counters with the search stats
+
+// Nothing open, every count -1. PerfStart, PerfStop & PerfClose then do nothing
+void PerfNone (_Perf *Perf)
+  {
+    int i;
+    //
+    for (i = 0; i < pcCount; i++)
+      {
+        Perf->Fd [i] = -1;
+        Perf->Count [i] = -1;
+      }
+  }
+
+void PerfOpen (_Perf *Perf)
+  {
+    PerfNone (Perf);
+#ifdef __linux__
+    int i;
+    static const uint32_t Type [pcCount] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+    static const uint64_t Config [pcCount] =
+      {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,   // Last Level Cache
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+      };
+    struct perf_event_attr Attr;
+    //
+    for (i = 0; i < pcCount; i++)
+      {
+        memset (&Attr, 0, sizeof (Attr));
+        Attr.size = sizeof (Attr);
+        Attr.type = Type [i];
+        Attr.config = Config [i];
+        Attr.disabled = 1;
+        Attr.exclude_kernel = 1;
+        Attr.exclude_hv = 1;
+        Attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        Perf->Fd [i] = syscall (SYS_perf_event_open, &Attr, 0, -1, -1, 0);   // This thread, any CPU
+      }
+#endif
+  }
+
+void PerfStart (_Perf *Perf)
+  {
+#ifdef __linux__
+    int i;
+    //
+    for (i = 0; i < pcCount; i++)
+      if (Perf->Fd [i] >= 0)
+        {
+          ioctl (Perf->Fd [i], PERF_EVENT_IOC_RESET, 0);
+          ioctl (Perf->Fd [i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+  }
+
+void PerfStop (_Perf *Perf)
+  {
+#ifdef __linux__
+    int i;
+    uint64_t n [3];   // Count, time enabled, time running
+    //
+    for (i = 0; i < pcCount; i++)
+      if (Perf->Fd [i] >= 0)
+        {
+          ioctl (Perf->Fd [i], PERF_EVENT_IOC_DISABLE, 0);
+          Perf->Count [i] = -1;
+          if (read (Perf->Fd [i], n, sizeof (n)) == sizeof (n) && n [2] > 0)   // Never scheduled: not counted
+            if (n [2] < n [1])
+              Perf->Count [i] = (int64_t) ((double) n [0] * n [1] / n [2]);
+            else
+              Perf->Count [i] = n [0];
+        }
+#endif
+  }
+
+void PerfClose (_Perf *Perf)
+  {
+    int i;
+    //
+    for (i = 0; i < pcCount; i++)
+      if (Perf->Fd [i] >= 0)
+        {
+          close (Perf->Fd [i]);
+          Perf->Fd [i] = -1;
+        }
+  }
+
+// eg "Cycles 812.345M, Instr 1501.200M (1.84 IPC), Branch miss 3.120M, ..."
+void PerfToStr (char **s, int64_t *Count)
+  {
+    char St [40];
+    int i;
+    bool First;
+    //
+    First = true;
+    for (i = 0; i < pcCount; i++)
+      if (Count [i] >= 0)
+        {
+          if (!First)
+            StrCat (s, ", ");
+          First = false;
+          StrCat (s, PerfNames [i]);
+          StrCat (s, ' ');
+          snprintf (St, sizeof (St), "%lld.%03lldM", (long long) (Count [i] / 1000000), (long long) (Count [i] / 1000 % 1000));   // int64: long searches pass 2G
+          StrCat (s, St);
+          if (i == pcInstructions && Count [pcCycles] > 0)
+            {
+              StrCat (s, " (");
+              IntToStrDecimals (s, (int) (Count [i] * 100 / Count [pcCycles]), 2);
+              StrCat (s, " IPC)");
+            }
+        }
+    if (First)
+      StrCat (s, "No counters");
+  }
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// THREADS & MEMORY
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+const size_t LargePage = 2 << 20;   // Huge page size on x86-64 & most ARM64
+
+int PinCPU = -1;   // Search threads run on this CPU (so their memory stays on its node). -1 = let the OS choose
+
+// Call at the start of a search thread
+void ThreadPin (void)
+  {
+#ifdef __linux__
+    cpu_set_t Set;
+    //
+    if (PinCPU >= 0 && PinCPU < CPU_SETSIZE)
+      {
+        CPU_ZERO (&Set);
+        CPU_SET (PinCPU, &Set);
+        sched_setaffinity (0, sizeof (Set), &Set);   // fails harmlessly if there's no such CPU
+      }
+#endif
+  }
+
+// Memory for big search tables, on huge pages where possible to save TLB misses.
+// Pages are only placed when first touched, so touch them from the thread (CPU) that uses them
+void *LargeAlloc (size_t Size)
+  {
+#ifdef __linux__
+    void *p;
+    //
+    Size = (Size + LargePage - 1) & ~(LargePage - 1);   // Whole huge pages
+    p = mmap (NULL, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);   // Reserved huge pages
+    if (p == MAP_FAILED)
+      {
+        p = mmap (NULL, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+          return NULL;
+        madvise (p, Size, MADV_HUGEPAGE);   // Transparent huge pages
+      }
+    return p;
+#else
+    return malloc (Size);
+#endif
+  }
+
+void LargeFree (void *p, size_t Size)
+  {
+    if (p)
+#ifdef __linux__
+      munmap (p, (Size + LargePage - 1) & ~(LargePage - 1));
+#else
+      free (p);
+#endif
+  }
+
+// % of the mapping at p that's on huge pages, from /proc/self/smaps. -1 if unknown
+int LargeHugePercent (void *p)
+  {
+    int Res = -1;
+#ifdef __linux__
+    FILE *f;
+    char Line [256];
+    unsigned long Start, End, kB, Size;
+    bool Found;
+    //
+    f = fopen ("/proc/self/smaps", "r");
+    if (f == NULL)
+      return -1;
+    Found = false;
+    Size = 0;
+    while (fgets (Line, sizeof (Line), f))
+      if (sscanf (Line, "%lx-%lx ", &Start, &End) == 2)   // A mapping's first line
+        {
+          if (Found)
+            break;
+          Found = (unsigned long) p >= Start && (unsigned long) p < End;
+          Size = (End - Start) / 1024;
+        }
+      else if (Found && Size)
+        if (sscanf (Line, "AnonHugePages: %lu kB", &kB) == 1 || sscanf (Line, "Private_Hugetlb: %lu kB", &kB) == 1)
+          Res = Max (Res, (int) (kB * 100 / Size));
+    fclose (f);
+#endif
+    return Res;
+  }
+
+
+bool DebugConsole = true;   // DebugAdd () echoes to stdout while starting up. After that only DebugError () does
+
+// Message, and Item if there's one, to stdout with the ms since the first call and since the last
+void DebugPrint (const char *Message, const char *Item)
   {
     static int Time0 = ClockMS ();
     static int Time1 = Time0;
-    char *s = (char *) malloc (StrLen (Message) + 32);
+    char s [32];
     char *ps = s;
     int t;
     //
@@ -44,12 +449,29 @@ void DebugAdd (const char* Message)
     IntToStrDecimals (&ps, t - Time1, 3);
     Time1 = t;
     StrCat (&ps, "] ");
-    StrCat (&ps, Message);
     *ps = 0;
     //
-    puts (s);
-    //Log ("Log", s);
-    free (s);
+    fputs (s, stdout);
+    if (Item)
+      {
+        fputs (Message, stdout);
+        puts (Item);
+      }
+    else
+      puts (Message);
+  }
+
+void DebugAdd (const char* Message)
+  {
+    TraceMarkText (Message);
+    if (DebugConsole)
+      DebugPrint (Message, NULL);
+  }
+
+void DebugError (const char *Message, const char *Item)
+  {
+    TraceMarkText (Message);
+    DebugPrint (Message, Item);
   }
 
 void CoordToStr (char **s, _Coord Pos)
@@ -58,33 +480,227 @@ void CoordToStr (char **s, _Coord Pos)
     *(*s)++ = Pos.y + '1';
   }
 
+const int PathMax = 300;   // Size of every HomePath () buffer
+
+// Name in the home directory, into Path [PathMax]. Cut short if $HOME is absurdly long
+void HomePath (char *Path, const char *Name)
+  {
+    const char *Home;
+    //
+    Home = getenv ("HOME");
+    if (Home == NULL)
+      Home = getenv ("USERPROFILE");
+    if (Home == NULL)
+      Home = ".";
+    snprintf (Path, PathMax, "%s/%s", Home, Name);
+  }
+
 bool Refresh;
 bool Exit;
 bool Load;
 bool Save;
 bool SaveLog;
+bool SaveTrace;
+bool SavePGN;
+bool ImportPGN;
 bool PCPlayForever;
 
 bool PlayThreadWhite;
 bool PlayThreadStarted;
 bool PlayThreadFinished;
+bool PlayThreadCached;   // Move came from the Position Cache, no search done
 int PlayThreadScore;
 int PlayThreadTime;
+_Perf PlayThreadPerf;   // Counted if PerfEnabled
+int SearchStartTime;   // ClockMS () when the current search started
 
 int PlayThread (void *PlayWhite)
   {
+    int64_t Start;
+    //
+    TraceThread = ttPlay;
+    ThreadPin ();
     PlayThreadWhite = (bool) PlayWhite;
     PlayThreadStarted = true;
     PlayThreadFinished = false;
     MovesConsidered = 0;
     PlayThreadTime = ClockMS ();
+    if (PerfEnabled)
+      PerfOpen (&PlayThreadPerf);   // Counters are per thread, so open them here
+    else
+      PerfNone (&PlayThreadPerf);
+    PerfStart (&PlayThreadPerf);
+    Start = TraceNS ();
     PlayThreadScore = BestMove (PlayThreadWhite, 0);
+    PerfStop (&PlayThreadPerf);
+    PerfClose (&PlayThreadPerf);
+    TraceAdd ("BestMove", Start, TraceNS () - Start, DepthPlay);   // before Finished, so the next PlayThread can't share the ring
     PlayThreadTime = ClockMS () - PlayThreadTime;
+    PlayThreadStarted = false;   // before Finished: the main loop may start the next one as soon as it sees Finished
+    __sync_synchronize ();
     PlayThreadFinished = true;
-    PlayThreadStarted = false;
     return 0;
   }
 
+bool AnalyseThreadStarted;
+bool AnalyseThreadFinished;
+bool AnalyseContinuous;   // Ever deepening background Analysis while Editing. The Board may still be dragged
+volatile bool AnalyseAbort;
+bool AnalyseResume;   // Background Analysis was stopped for a menu item: start it again after
+int DepthUser;   // DepthPlay as set, while AnalyseThread has DepthPlay for its own depths
+bool MateThreadStarted;
+bool MateThreadFinished;
+volatile bool MateAbort;
+bool PgnThreadStarted;   // PGN Import replays its games on the Board too
+bool PgnThreadFinished;
+volatile bool PgnAbort;
+
+// Is a search using Board [][]? Only one may run, and the GUI mustn't change the Board meanwhile
+bool EngineBusy (void)
+  {
+    return PlayThreadStarted || AnalyseThreadStarted || MateThreadStarted || PgnThreadStarted;
+  }
+
+// Can the Board be dragged? Only background Analysis is happy to be interrupted
+bool BoardInputAllowed (void)
+  {
+    return !PlayThreadStarted && !MateThreadStarted && !PgnThreadStarted && (!AnalyseThreadStarted || AnalyseContinuous);
+  }
+
+_Piece BoardView [8][8];   // Copy of Board [][] to draw while the engine is busy with it
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ATTACKS & STATIC EXCHANGE
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Piece values used to resolve exchanges, in Board Score units (Pawn = 1.000). Indexed by Piece ()
+int ExchangeValue [8] = {0, 100000, 9000, 5000, 3000, 3000, 1000};
+
+bool OnBoard (int x, int y)
+  {
+    return x >= 0 && x < 8 && y >= 0 && y < 8;
+  }
+
+// Find the pieces of colour White attacking square Sq of board B. Returns the count. List may be NULL
+int Attackers (_Piece B [8][8], _Coord Sq, bool White, _Coord *List)
+  {
+    static const int Jump [8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+    static const int Ray [8][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}, {1, 1}, {1, -1}, {-1, 1}, {-1, -1}};   // Straight then Diagonal
+    int n, d, x, y, Dist, pc;
+    _Piece p;
+    //
+    n = 0;
+    y = Sq.y + (White ? -1 : 1);   // Pawns attack from one row behind
+    for (d = -1; d <= 1; d += 2)
+      {
+        x = Sq.x + d;
+        if (OnBoard (x, y))
+          if (Piece (B [x][y]) == pPawn && PieceWhite (B [x][y]) == White)
+            {
+              if (List)
+                List [n] = {x, y};
+              n++;
+            }
+      }
+    for (d = 0; d < 8; d++)   // Knights
+      {
+        x = Sq.x + Jump [d][0];
+        y = Sq.y + Jump [d][1];
+        if (OnBoard (x, y))
+          if (Piece (B [x][y]) == pKnight && PieceWhite (B [x][y]) == White)
+            {
+              if (List)
+                List [n] = {x, y};
+              n++;
+            }
+      }
+    for (d = 0; d < 8; d++)   // Sliding pieces & King
+      {
+        x = Sq.x;
+        y = Sq.y;
+        Dist = 0;
+        while (true)
+          {
+            x += Ray [d][0];
+            y += Ray [d][1];
+            Dist++;
+            if (!OnBoard (x, y))
+              break;
+            p = B [x][y];
+            if (Piece (p) != pEmpty)   // first piece on this ray
+              {
+                pc = Piece (p);
+                if (PieceWhite (p) == White)
+                  if (pc == pQueen || (pc == pRook && d < 4) || (pc == pBishop && d >= 4) || (pc == pKing && Dist == 1))
+                    {
+                      if (List)
+                        List [n] = {x, y};
+                      n++;
+                    }
+                break;
+              }
+          }
+      }
+    return n;
+  }
+
+// Static Exchange Evaluation of moving From -> To on Board.
+// Both sides keep recapturing on To with their least valuable piece, and may stop when it suits them.
+// Returns the material won (+ve) or lost (-ve) by the side moving
+int StaticExchange (_Coord From, _Coord To)
+  {
+    _Piece B [8][8];
+    _Coord List [16];
+    int Gain [32];
+    int d, i, n, Low, OnSquare;
+    bool White;
+    //
+    memcpy (B, Board, sizeof (B));
+    White = PieceWhite (B [From.x][From.y]);
+    Gain [0] = ExchangeValue [Piece (B [To.x][To.y])];
+    OnSquare = ExchangeValue [Piece (B [From.x][From.y])];
+    B [From.x][From.y] = pEmpty;   // Removing the mover exposes any x-ray attackers behind it
+    d = 0;
+    while (true)
+      {
+        d++;
+        Gain [d] = OnSquare - Gain [d - 1];   // if the piece now on To is taken
+        if (d + 1 >= SIZEARRAY (Gain))
+          break;
+        White = !White;
+        n = Attackers (B, To, White, List);
+        if (n == 0)
+          break;
+        Low = 0;
+        for (i = 1; i < n; i++)
+          if (ExchangeValue [Piece (B [List [i].x][List [i].y])] < ExchangeValue [Piece (B [List [Low].x][List [Low].y])])
+            Low = i;
+        OnSquare = ExchangeValue [Piece (B [List [Low].x][List [Low].y])];
+        B [List [Low].x][List [Low].y] = pEmpty;
+      }
+    while (--d)
+      Gain [d - 1] = -Max (-Gain [d - 1], Gain [d]);
+    return Gain [0];
+  }
+
+char Controlled [8][8][2];   // Number of Black [0] & White [1] pieces attacking each square of Board
+
+// Rebuild Controlled [][] after Board changes (a move, an undo, an edit or a load)
+void ControlledUpdate (void)
+  {
+    int x, y;
+    //
+    for (y = 0; y < 8; y++)
+      for (x = 0; x < 8; x++)
+        {
+          Controlled [x][y][0] = Attackers (Board, {x, y}, false, NULL);
+          Controlled [x][y][1] = Attackers (Board, {x, y}, true, NULL);
+        }
+  }
+
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -165,7 +781,8 @@ class _ChessBoard: public _Container
       bool MoveWhite;
       _Coord Move [2][2];   // Colour * From/To
       bool LegalMovesShow;
-      bool LegalMoves [8][8];
+      char LegalMoves [8][8];   // 0 = No, 1 = Legal move, 2 = Capture that loses material
+      bool ControlShow;   // Tint squares by Controlled [][]
       //
       _ChessBoard (_Container *Parent, _Rect Rect);
       void DrawCustom (void);
@@ -173,7 +790,11 @@ class _ChessBoard: public _Container
       void TranslateCoord (_Coord *Pos);
       void BoardSquare (_Coord Pos, _Rect *Res);
       _Point BoardSquareCenter (_Coord Pos);
-      void DrawVector (_Coord Move []);
+      _Coord Hints [5][2];   // Best moves from Analysis, best first
+      int HintsCount;
+      _Coord EditSquare;   // Edit: put EditPiece here once the engine lets go of the Board (x < 0 if none)
+      _Piece EditPiece;
+      void DrawVector (_Coord Move [], int Col = cBlack, int Weight = 1);
   };
 
 _ChessBoard::_ChessBoard (_Container *Parent, _Rect Rect) : _Container (Parent, Rect)
@@ -187,11 +808,29 @@ _ChessBoard::_ChessBoard (_Container *Parent, _Rect Rect) : _Container (Parent,
       Move [c][0] = Move [c][1] = {-1, -1};
     LegalMovesShow = true;
     memset (LegalMoves, false, sizeof (LegalMoves));
+    ControlShow = false;
+    HintsCount = 0;
+    EditSquare = {-1, -1};
   }
 
 const int cGreenGray = 0x9cf09c;
 const int cBlueGray = 0xffaaaa;
 
+// Blend Colour1 into Colour0 by Percent (0..100)
+int ColourMix (int Colour0, int Colour1, int Percent)
+  {
+    int Res, Shift, c0, c1;
+    //
+    Res = 0;
+    for (Shift = 0; Shift < 24; Shift += 8)
+      {
+        c0 = (Colour0 >> Shift) & 0xFF;
+        c1 = (Colour1 >> Shift) & 0xFF;
+        Res |= (c0 + (c1 - c0) * Percent / 100) << Shift;
+      }
+    return Res;
+  }
+
 void _ChessBoard::TranslateCoord (_Coord *Pos)
   {
     if (Rotate)
@@ -216,7 +855,7 @@ _Point _ChessBoard::BoardSquareCenter (_Coord Pos)
     return {Pos.x * dx + dx / 2, (7 - Pos.y) * dy + dy / 2};
   }
 
-void _ChessBoard::DrawVector (_Coord Move [])
+void _ChessBoard::DrawVector (_Coord Move [], int Col, int Weight)
   {
     _Point p0, p1;
     int Width;
@@ -225,14 +864,15 @@ void _ChessBoard::DrawVector (_Coord Move [])
       {
         p0 = BoardSquareCenter (Move [0]);
         p1 = BoardSquareCenter (Move [1]);
-        Width = Max (1, Rect.Width / 8 / 40);
-        DrawLine (p0.x, p0.y, p1.x, p1.y, cBlack, Width);//cGreenGray cGrayDark cGray
-        DrawCircle (p0.x, p0.y, 3 * Width, -1, cBlack, 0);//
+        Width = Max (1, Rect.Width / 8 / 40) * Weight;
+        DrawLine (p0.x, p0.y, p1.x, p1.y, Col, Width);//cGreenGray cGrayDark cGray
+        DrawCircle (p0.x, p0.y, 3 * Width, -1, Col, 0);//
       }
   }
 
 void _ChessBoard::DrawCustom (void)
   {
+    _TraceSpan Span ("DrawCustom");
     _Rect Square, s;
     _Point Center;
     int x, y, Pass;
@@ -240,6 +880,7 @@ void _ChessBoard::DrawCustom (void)
     char St [8], *c;
     int WidthLine;
     int WidthCross;
+    int Col;
     //
     Rotate = !PlayerWhite && RotateAllowed;
     WidthLine = Max (1, Rect.Width / 8 / 24);
@@ -255,13 +896,19 @@ void _ChessBoard::DrawCustom (void)
               BoardSquare ({x, y}, &Square);
               Center = BoardSquareCenter ({x, y});
               ColourGrad = Colour = Colours [(x ^ y) & 1];
+              if (ControlShow)   // Heatmap: White control blue, Black control red
+                {
+                  Col = Controlled [x][y][1] - Controlled [x][y][0];
+                  if (Col)
+                    ColourGrad = Colour = ColourMix (Colour, Col > 0 ? cBlue : cRed, Min (abs (Col), 3) * 15);
+                }
               if (MoveStart)
                 if ((x == Move [MoveWhite][0].x && y == Move [MoveWhite][0].y) || (x == Move [MoveWhite][1].x && y == Move [MoveWhite][1].y))
                   Colour = cWhite;//%%%%
               if (Pass == 0)
                 {
                   DrawRectangle (Square, cBlack, cBlack, Colour);   // Background
-                  p = Board [x][y];
+                  p = EngineBusy () ? BoardView [x][y] : Board [x][y];
                   if (Piece (p) != pEmpty)
                     {
                       c = St;   // Piece
@@ -273,8 +920,9 @@ void _ChessBoard::DrawCustom (void)
                     DrawCircle (Center.x, Center.y, Max (Rect.Width / 8 / 16, 1), cRed, ColourAdjust (cRed, 150), 1);
                   if (LegalMovesShow && LegalMoves [x][y])   // Legal moves
                     {
-                      DrawLine (Center.x - WidthCross, Center.y - WidthCross, Center.x + WidthCross, Center.y + WidthCross, cWhite, WidthLine);
-                      DrawLine (Center.x + WidthCross, Center.y - WidthCross, Center.x - WidthCross, Center.y + WidthCross, cWhite, WidthLine);
+                      Col = LegalMoves [x][y] == 2 ? cRed : cWhite;
+                      DrawLine (Center.x - WidthCross, Center.y - WidthCross, Center.x + WidthCross, Center.y + WidthCross, Col, WidthLine);
+                      DrawLine (Center.x + WidthCross, Center.y - WidthCross, Center.x - WidthCross, Center.y + WidthCross, Col, WidthLine);
                     }
                 }
               else   // Pass == 1
@@ -294,13 +942,11 @@ void _ChessBoard::DrawCustom (void)
                         TextOutAligned (s, St, Rotate ? aLeft : aRight, Rotate ? aTop : aBottom);
                       }
                     ColourText = -1;   // back to normal (black)
-                    /*if (Controlled [x][y] & 0x01)   // Controlled by Black
-                      DrawCircle (Square.x + 4, Square.y + 4, 4, -1, cBlack);
-                    if (Controlled [x][y] & 0x02)   // Controlled by White
-                      DrawCircle (Square.x + 4, Square.y + 8, 4, -1, cWhite);*/
                   }
             }
       }
+    for (x = HintsCount - 1; x >= 0; x--)   // Analysis: best drawn last, on top
+      DrawVector (Hints [x], x ? cGrayDark : cGreenGray, x ? 1 : 2);
     DrawVector (Move [0]);
     DrawVector (Move [1]);
     Colour = -1;   // Revert to transparent
@@ -313,17 +959,17 @@ bool _ChessBoard::ProcessEventCustom (_Event *Event, _Point Offset)
     _Piece p;
     //
     Res = false;
-    if (Event->Type == etMouseDown)//####
-      DebugAddHex ("etMouseDown", Event->MouseKeys);//####
+    if (Event->Type == etMouseDown)
+      TraceMark ("MouseDown", Event->MouseKeys);
     if (IsEventMine (Event, Offset))
       if (Event->Type == etMouseDown && (Event->MouseKeys == (Bit [KeyMouseLeft - 1] | Bit [KeyMouseRight - 1]) || PCPlayForever))
         PCPlayForever = !PCPlayForever;
-      else if (!PlayThreadStarted)
+      else if (BoardInputAllowed ())
         {
           Sel.x = (Event->X - Offset.x) / (Rect.Width / 8);
           Sel.y = 7 - ((Event->Y - Offset.y) / (Rect.Height / 8));
           TranslateCoord (&Sel);
-          p = Board [Sel.x][Sel.y];
+          p = EngineBusy () ? BoardView [Sel.x][Sel.y] : Board [Sel.x][Sel.y];
           if (Event->Type == etMouseDown && Event->Key == KeyMouseLeft)
             {
               if (Piece (p) != pEmpty)
@@ -334,13 +980,16 @@ bool _ChessBoard::ProcessEventCustom (_Event *Event, _Point Offset)
                   Move [MoveWhite][1] = Sel;
                   // Store possible moves in MovePos []
                   memset (LegalMoves, false, sizeof (LegalMoves));
-                  if (Piece (Board [Sel.x][Sel.y]) != pEmpty)
+                  if (!EngineBusy ())
                     {
                       GetPieceMoves (Sel, Moves, Analysis);
                       m = Moves;
                       while (m->x >= 0)   // for all moves
                         {
-                          LegalMoves [m->x][m->y] = true;
+                          LegalMoves [m->x][m->y] = 1;
+                          if (Piece (Board [m->x][m->y]) != pEmpty)   // Capture
+                            if (StaticExchange (Sel, *m) < 0)
+                              LegalMoves [m->x][m->y] = 2;
                           m++;
                         }
                     }
@@ -371,7 +1020,10 @@ bool _ChessBoard::ProcessEventCustom (_Event *Event, _Point Offset)
                     MoveStart = false;
                   }
                 else
-                  MoveComplete = true;
+                  {
+                    AnalyseAbort = true;   // Position is about to change: let the Main Loop have the Board
+                    MoveComplete = true;
+                  }
                 memset (LegalMoves, false, sizeof (LegalMoves));
                 Invalidate (true);
                 Res = true;
@@ -383,574 +1035,4237 @@ bool _ChessBoard::ProcessEventCustom (_Event *Event, _Point Offset)
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //
-// GLOBALS
+// POSITION CACHE
+//
+// PC moves, keyed by a Zobrist hash of the Board, kept in a fixed size file next to the settings.
+// Loaded at start, written back at exit when changed.
 //
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-class _FormMain: public _Form
+#define FileCache ".ChessCache"
+
+uint64_t ZobristPiece [2][8][64];   // Colour * Piece * Square
+uint64_t ZobristBlack;   // Black to move
+uint64_t ZobristEnPassant [8];   // Column of a pawn that can be taken En-Passant
+uint64_t ZobristCastle [2][2];   // Colour * Queen / King side
+
+// Fill the Zobrist tables. A fixed seed so keys stay valid in the cache file between runs
+void ZobristInit (void)
   {
-    public:
-      const int LogsSize = 4000;
-      const int BoardWidth = 500;
-      char *Logs, *sLogs;
-      _Piece Graveyard [2][64];
-      int ColourBG [2];
-      //
-      _Container *Toolbar;
-      _Button *bProperties, *bUndo, *bPlay, *bRestart, *bEdit, *bHelp, *bQuit;
-      _Label *lMessage;
-      _Label *lGraveyard;
-      _ChessBoard *cBoard;
-      _Label *lLogs;
-      _Label *lPCStats;
-      //
-      _Wait *Wait;
-      _MenuPopup *Menu;
-      _MenuPopup *mPieces;
-      //
-      _FormMain (char *Title);
-     ~_FormMain ();
-  };
-
-_FormMain *fMain;
-
-bool PCPlays;
+    static bool Done = false;
+    uint64_t r;
+    int c, p, i;
+    //
+    if (Done)
+      return;
+    Done = true;
+    r = 0x9E3779B97F4A7C15ULL;
+    for (c = 0; c < 2; c++)
+      for (p = 0; p < 8; p++)
+        for (i = 0; i < 64; i++)
+          {
+            r ^= r << 13; r ^= r >> 7; r ^= r << 17;   // xorshift64
+            ZobristPiece [c][p][i] = r;
+          }
+    r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+    ZobristBlack = r;
+    for (i = 0; i < 8; i++)
+      {
+        r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+        ZobristEnPassant [i] = r;
+      }
+    for (c = 0; c < 2; c++)
+      for (i = 0; i < 2; i++)
+        {
+          r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+          ZobristCastle [c][i] = r;
+        }
+  }
 
-bool Undo;
-bool PCPlay;
-bool Analyse;
-bool Restart;
+// Can White (or Black) still castle to Side (0 = Queen side, 1 = King side)? King & Rook at home & never moved
+bool CastleRight (bool White, int Side)
+  {
+    _Piece k, r;
+    int y;
+    //
+    y = White ? 0 : 7;
+    k = Board [4][y];
+    r = Board [Side ? 7 : 0][y];
+    return Piece (k) == pKing && PieceWhite (k) == White && k / pMoveID == 0 &&
+           Piece (r) == pRook && PieceWhite (r) == White && r / pMoveID == 0;
+  }
 
-char *Path;
+// Hash of Board [][], the side to move & castling rights
+uint64_t PositionKey (void)
+  {
+    uint64_t Key;
+    int x, y, c;
+    _Piece p;
+    //
+    ZobristInit ();
+    Key = 0;
+    for (y = 0; y < 8; y++)
+      for (x = 0; x < 8; x++)
+        {
+          p = Board [x][y];
+          if (Piece (p) != pEmpty)
+            {
+              Key ^= ZobristPiece [PieceWhite (p)][Piece (p)][x + 8 * y];
+              if ((p & pPawn2) && (p / pMoveID == MoveID))   // Just moved 2: can be taken En-Passant
+                Key ^= ZobristEnPassant [x];
+            }
+        }
+    if (MoveID & 1)
+      Key ^= ZobristBlack;
+    for (c = 0; c < 2; c++)
+      for (x = 0; x < 2; x++)
+        if (CastleRight (c, x))
+          Key ^= ZobristCastle [c][x];
+    return Key;
+  }
 
 typedef struct
   {
-    _Coord From;
-    _Coord To;
-    _Piece OldFrom;
-    _Piece OldTo;
-    _SpecialMove SpecMov;
-    char *Log;
-  } _UndoItem;
+    uint64_t Key;
+    int32_t Score;
+    uint16_t Weights [4];   // AnalysisScore... when scored
+    uint8_t Depth;   // DepthPlay when scored
+    uint8_t Analysis;
+    uint8_t From, To;   // x + 8 * y. Equal in an empty entry
+    bool NoDraws;
+  } _CacheEntry;
 
-_UndoItem UndoStack [1000];
+const char CacheMagic [8] = "Chess3C";   // 2: castling rights in the Key, 3: NoDraws
+const int CacheSize = 1 << 16;   // Entries. Must be a power of 2
+const int CacheSaveMS = 60000;   // Longest a changed cache waits to be saved. It's all rewritten, so not often
 
-int UndoStackSize;
+bool NoDraws = true;   // CheckRepeat () forbids a move that repeats: it changes what's played, so entries keep it
+bool CacheEnabled = true;
+_CacheEntry *Cache;
+bool CacheDirty;
+int CacheSaveTime;
 
-int StrChangeChar (char *p, char c1, char c2)
+void CacheLoad (void)
   {
-    int n;
+    int f;   // file ID
+    char Magic [8];
     //
-    n = 0;
-    while (*p)
+    Cache = (_CacheEntry *) malloc (CacheSize * sizeof (_CacheEntry));
+    memset (Cache, 0, CacheSize * sizeof (_CacheEntry));
+    CacheDirty = false;
+    CacheSaveTime = ClockMS ();
+    f = FileOpen_ (FileCache, foRead);
+    if (f >= 0)
       {
-        if (*p == c1)
-          {
-            *p = c2;
-            n++;
-          }
-        p++;
+        if (FileSize (f) == sizeof (Magic) + CacheSize * sizeof (_CacheEntry))
+          if (FileRead (f, (byte *) Magic, sizeof (Magic)) == sizeof (Magic) && memcmp (Magic, CacheMagic, sizeof (Magic)) == 0)
+            if (FileRead (f, (byte *) Cache, CacheSize * sizeof (_CacheEntry)) != CacheSize * (int) sizeof (_CacheEntry))
+              memset (Cache, 0, CacheSize * sizeof (_CacheEntry));   // Damaged. Start again
+        FileClose (f);
       }
-    return n;
   }
 
-char *RemoveTextFormats (char *St)
+bool CacheSave (void)
   {
-    char *Res, *r;
+    int f;   // file ID
+    bool Res;
     //
-    Res = NULL;
-    StrAssignCopy (&Res, St);
-    r = Res;
-    while (true)
+    Res = true;
+    if (Cache && CacheDirty)
       {
-        r = StrPos (r, '\a');
-        if (r == NULL)
-          break;
-        StrDelete (r, 2);
+        Res = false;
+        f = FileOpen_ (FileCache, foWrite);
+        if (f >= 0)
+          {
+            Res = FileWrite (f, (byte *) CacheMagic, sizeof (CacheMagic)) && FileWrite (f, (byte *) Cache, CacheSize * sizeof (_CacheEntry));
+            FileClose (f);
+            CacheDirty = false;
+          }
       }
-    r = Res;
-    while (true)
+    return Res;
+  }
+
+// Save the cache if it's changed, at most every CacheSaveMS, so a crash loses little
+void CacheSync (void)
+  {
+    if (CacheDirty && ClockMS () - CacheSaveTime >= CacheSaveMS)
       {
-        r = StrPos (r, '\v');
-        if (r == NULL)
-          break;
-        *r = tab;
+        CacheSave ();
+        CacheSaveTime = ClockMS ();
       }
-    return Res;
   }
 
-bool FileWriteLine_ (int f, char *Line)
+// Can the cache be used for this search? Not if the result would have been different
+bool CacheUsable (void)
   {
-    bool Res;
+    return Cache && CacheEnabled && Randomize == 0 && MoveForbidenFrom.x < 0;
+  }
+
+bool CacheWeightsMatch (_CacheEntry *ce)
+  {
+    return ce->Analysis == Analysis && ce->NoDraws == NoDraws &&
+           ce->Weights [0] == AnalysisScorePiece && ce->Weights [1] == AnalysisScoreMove &&
+           ce->Weights [2] == AnalysisScoreAttack && ce->Weights [3] == AnalysisScoreAttackInd;
+  }
+
+// Look up the current Board. If known to DepthPlay or better, set BestA [0], BestB [0] & PlayThreadScore
+bool CacheFind (void)
+  {
+    uint64_t Key;
+    _CacheEntry *ce;
+    _Coord From, To;
     //
-    StrChangeChar (Line, '\n', ',');
-    Res = FileWriteLine (f, Line);
-    StrChangeChar (Line, ',', '\n');
-    return Res;
+    if (!CacheUsable ())
+      return false;
+    Key = PositionKey ();
+    ce = &Cache [Key & (CacheSize - 1)];
+    if (ce->From == ce->To || ce->Key != Key || ce->Depth < DepthPlay || !CacheWeightsMatch (ce))
+      return false;
+    From = {ce->From & 7, ce->From >> 3};
+    To = {ce->To & 7, ce->To >> 3};
+    if (!MoveValid (From, To))   // Keys can collide
+      return false;
+    BestA [0] = From;
+    BestB [0] = To;
+    PlayThreadScore = ce->Score;
+    return true;
   }
 
-void GameSave (char *Name, void *Parameter)
+void CacheStore (int Score, _Coord From, _Coord To)
   {
-    int f;   // file ID
-    char *Line, *l;
-    int x, y;
-    _Piece *p;
+    uint64_t Key;
+    _CacheEntry *ce;
     //
-    Line = (char *) malloc (fMain->LogsSize + 100);
-    f = FileOpen (Name, foWrite);
-    if (f >= 0)
-      {
-        l = Line;
-        StrCat (&l, "Board\t");
-        for (y = 0; y < 8; y++)
-          for (x = 0; x < 8; x++)
-            {
-              NumToStrBase (&l, Board [x][y], 0, 16);
-              StrCat (&l, ',');
-            }
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        //
-        l = Line;
-        StrCat (&l, "PlayerWhite\t");
-        NumToStr (&l, PlayerWhite);
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        //
-        l = Line;
-        StrCat (&l, "Graveyard\t");
-        for (y = 0; y <= 1; y++)
-          {
-            p = fMain->Graveyard [y];
-            while (*p != pEmpty)
-              {
-                NumToHex (&l, *p++);
-                StrCat (&l, ',');
-              }
-            StrCat (&l, '\t');
-          }
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        //
-        l = Line;
-        StrCat (&l, "Logs\t");
-        StrCat (&l, fMain->Logs);
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        //
-        l = Line;
-        StrCat (&l, "Moves\t");
-        NumToStr (&l, MoveID);
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        FileClose (f);
-      }
-    else
-      StrCat (&fMain->sLogs, "*** ERROR SAVING FILE ***\n");
-    free (Line);
+    if (!CacheUsable () || Score == MININT)
+      return;
+    Key = PositionKey ();
+    ce = &Cache [Key & (CacheSize - 1)];
+    if (ce->Key == Key && ce->Depth > DepthPlay && CacheWeightsMatch (ce))   // Already know better
+      return;
+    ce->Key = Key;
+    ce->Score = Score;
+    ce->Weights [0] = AnalysisScorePiece;
+    ce->Weights [1] = AnalysisScoreMove;
+    ce->Weights [2] = AnalysisScoreAttack;
+    ce->Weights [3] = AnalysisScoreAttackInd;
+    ce->Depth = DepthPlay;
+    ce->Analysis = Analysis;
+    ce->NoDraws = NoDraws;
+    ce->From = From.x + 8 * From.y;
+    ce->To = To.x + 8 * To.y;
+    CacheDirty = true;
   }
 
-void GameLoad (char *Name, void *Parameter)
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ROOT ANALYSIS
+//
+// Multi-PV: every legal move of the side to play is searched once per depth with BestMove ()
+// from the reply onwards, so the best N moves come from a single pass. Once N are scored, the
+// rest only need to show they're no better than the Nth: a null window, cut at the replies.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+const int ScoreMate = 1000000;
+const int DepthMax = 9;
+
+typedef struct
   {
-    int f;   // file ID
-    int Size;
-    char *Data, *dp, *dp_;
-    int x, y;
-    _Piece *p;
-    int n;
+    _Coord From, To;
+    int Score;   // For the side moving. From the last completed depth
+    _Coord Reply [2];   // Best answer From / To (x < 0 if none)
+  } _RootMove;
+
+_RootMove RootMoves [256];
+int RootMovesCount;
+
+bool AnalyseWhite;   // Side analysed
+int AnalyseDepth;   // Deepest to go
+int AnalyseDepthDone;   // Depth of RootMoves [] scores
+int AnalyseLines = 3;   // Best moves shown. 0 = Analysis just shows Board Score
+_Coord AnalyseExact [2];   // A root move scored exactly, even if it's not in the best (the move played, Reviewing)
+
+// Fill List with the legal moves for White. Returns the number found
+int RootMovesGet (bool White, _RootMove *List)
+  {
+    _Coord From, Moves [64], *m;
+    _Piece OldFrom, OldTo;
+    _SpecialMove sm;
+    int n, x, y;
+    bool Legal;
     //
-    f = FileOpen (Name, foRead);
-    if (f >= 0)
-      {
-        fMain->Graveyard [0][0] = fMain->Graveyard [1][0] = pEmpty;
-        Size = FileSize (f);
-        Data = (char *) malloc (Size + 1);
-        FileRead (f, (byte *) Data, Size);
-        Data [Size] = 0;   // Terminate String
-        dp = Data;
-        while (*dp)
+    n = 0;
+    for (y = 0; y < 8; y++)
+      for (x = 0; x < 8; x++)
+        if (Piece (Board [x][y]) != pEmpty && PieceWhite (Board [x][y]) == White)
           {
-            // Break off a line
-            dp_ = StrPos (dp, '\n');
-            *dp_++ = 0;
-            // Look for a Data Name
-            if (StrMatch (&dp, "Board\t"))
-              {
-                x = y = 0;
-                while (true)
-                  {
-                    if (*dp == 0)
-                      break;
-                    Board [x][y] = (_Piece) StrGetHex (&dp);
-                    dp++;
-                    if (++x == 8)
-                      {
-                        x = 0;
-                        if (++y == 8)
-                          break;
-                      }
-                  }
-              }
-            else if (StrMatch (&dp, "PlayerWhite\t"))
-              PlayerWhite = StrGetNum (&dp);
-            else if (StrMatch (&dp, "Graveyard\t"))
+            From = {x, y};
+            GetPieceMoves (From, Moves, Analysis);
+            for (m = Moves; m->x >= 0; m++)
               {
-                p = fMain->Graveyard [0];
-                n = 0;
-                while (*dp && n < SIZEARRAY (fMain->Graveyard [0]))
+                OldFrom = Board [From.x][From.y];
+                OldTo = Board [m->x][m->y];
+                sm = MovePiece (From, *m);
+                Legal = !InCheck (White);
+                UnmovePiece (From, *m, OldFrom, OldTo, sm);
+                if (Legal)
                   {
-                    if (*dp == '\t')
-                      {
-                        p = fMain->Graveyard [1];
-                        n = 0;
-                        dp++;
-                      }
-                    if (*dp)
-                      {
-                        p [n++] = (_Piece) StrGetHex (&dp);
-                        p [n] = pEmpty;
-                      }
-                    if (*dp == ',')
-                      dp++;
+                    List [n].From = From;
+                    List [n].To = *m;
+                    List [n].Score = MININT;
+                    List [n].Reply [0] = List [n].Reply [1] = {-1, -1};
+                    n++;
                   }
               }
-            else if (StrMatch (&dp, "Logs\t"))
-              {
-                strcpy (fMain->Logs, dp);
-                StrChangeChar (fMain->Logs, ',', '\n');
-              }
-            else if (StrMatch (&dp, "Moves\t"))
-              MoveID = StrGetNum (&dp);
-            else
-              break;
-            dp = dp_;
           }
-        FileClose (f);
-        free (Data);
-        fMain->sLogs = StrPos (fMain->Logs, (char) 0);
-        UndoStackSize = 0;
-        fMain->cBoard->Move [0][0].x = -1;
-        fMain->cBoard->Move [1][0].x = -1;
-        fMain->lMessage->TextSet (NULL);
-        fMain->lMessage->VisibleSet (false);
-        Refresh = true;
-      }
-    else
-      StrCat (&fMain->sLogs, "*** ERROR LOADING FILE ***\n");
+    InCheck (White);   // Leave the King marked correctly
+    return n;
   }
 
-void LogSave (char *Name, void *Parameter)
+// Search one root move to DepthPlay. Returns its score for the side moving. With a Bound (MININT for
+// none) it's a null window: once a reply holds the move to Bound or less the other replies are
+// skipped, and the score is only an upper bound. BestMove () takes no window, so the cut is made
+// here at the replies: a move that isn't cut has had every reply searched, and its score is exact
+int RootMoveScore (bool White, _RootMove *rm, int Bound = MININT)
   {
-    int f;   // file ID
-    char *l;
+    _RootMove Replies [256], t;
+    _Piece OldFrom, OldTo, ReplyFrom, ReplyTo;
+    _SpecialMove sm, rsm;
+    int r, s, n, i;
     //
-    f = FileOpen (Name, foWrite);
-    if (f >= 0)
+    OldFrom = Board [rm->From.x][rm->From.y];
+    OldTo = Board [rm->To.x][rm->To.y];
+    sm = MovePiece (rm->From, rm->To);
+    n = 0;
+    if (Bound != MININT && DepthPlay > 2)   // Too shallow to be worth splitting
+      n = RootMovesGet (!White, Replies);
+    if (n == 0)   // Full window, or the opponent can't move
       {
-        l = RemoveTextFormats (fMain->Logs);
-        FileWrite (f, (byte *) l, StrLen (l));
-        FileClose (f);
-        free (l);
+        r = BestMove (!White, 1);
+        if (r == MININT)   // Opponent can't move
+          {
+            r = InCheck (!White) ? ScoreMate : 0;
+            rm->Reply [0] = rm->Reply [1] = {-1, -1};
+          }
+        else
+          {
+            r = -r;
+            rm->Reply [0] = BestA [1];
+            rm->Reply [1] = BestB [1];
+          }
       }
     else
-      StrCat (&fMain->sLogs, "*** ERROR SAVING FILE ***\n");
-  }
-
-#define FileSettings ".Chess"
-
-bool SettingsSave (void)
-  {
+      {
+        for (i = 1; i < n; i++)   // Last depth's best reply first: the likeliest to cut
+          if (Replies [i].From.x == rm->Reply [0].x && Replies [i].From.y == rm->Reply [0].y &&
+              Replies [i].To.x == rm->Reply [1].x && Replies [i].To.y == rm->Reply [1].y)
+            {
+              t = Replies [0];
+              Replies [0] = Replies [i];
+              Replies [i] = t;
+            }
+        r = 2 * ScoreMate;   // Above any score
+        for (i = 0; i < n && r > Bound && !AnalyseAbort; i++)
+          {
+            ReplyFrom = Board [Replies [i].From.x][Replies [i].From.y];
+            ReplyTo = Board [Replies [i].To.x][Replies [i].To.y];
+            rsm = MovePiece (Replies [i].From, Replies [i].To);
+            s = BestMove (White, 2);
+            if (s == MININT)   // We can't move
+              s = InCheck (White) ? -ScoreMate : 0;
+            UnmovePiece (Replies [i].From, Replies [i].To, ReplyFrom, ReplyTo, rsm);
+            if (s < r)
+              {
+                r = s;
+                rm->Reply [0] = Replies [i].From;
+                rm->Reply [1] = Replies [i].To;
+              }
+          }
+        InCheck (White);   // Leave the King marked correctly
+      }
+    UnmovePiece (rm->From, rm->To, OldFrom, OldTo, sm);
+    return r;
+  }
+
+// Results for the Main Loop to show while Analysis continues. Seq is odd while being written
+typedef struct
+  {
+    volatile int Seq;
+    bool White;
+    int Depth;
+    int Count;   // Root moves
+    _RootMove Best [5];
+    int DepthNow, Searched;   // Depth under way & root moves done at it
+    int Nodes;   // MovesConsidered
+    int Time;   // ms since the start
+    int64_t Perf [pcCount];   // Hardware counters for Depth, if PerfEnabled
+  } _AnalyseSnapshot;
+
+_AnalyseSnapshot AnalyseSnap;
+int64_t AnalysePerf [pcCount];   // Hardware counters of the last complete depth
+
+void AnalysePublish (int Searched)
+  {
+    int i;
+    //
+    AnalyseSnap.Seq++;
+    __sync_synchronize ();
+    AnalyseSnap.White = AnalyseWhite;
+    AnalyseSnap.Depth = AnalyseDepthDone;
+    AnalyseSnap.Count = RootMovesCount;
+    for (i = 0; i < Min (RootMovesCount, SIZEARRAY (AnalyseSnap.Best)); i++)
+      AnalyseSnap.Best [i] = RootMoves [i];
+    AnalyseSnap.DepthNow = DepthPlay;
+    AnalyseSnap.Searched = Searched;
+    AnalyseSnap.Nodes = MovesConsidered;
+    AnalyseSnap.Time = ClockMS () - SearchStartTime;
+    memcpy (AnalyseSnap.Perf, AnalysePerf, sizeof (AnalyseSnap.Perf));
+    __sync_synchronize ();
+    AnalyseSnap.Seq++;
+  }
+
+// Take a consistent copy of AnalyseSnap. False if it was being written
+bool AnalyseRead (_AnalyseSnapshot *Snap)
+  {
+    int Seq;
+    //
+    Seq = AnalyseSnap.Seq;
+    __sync_synchronize ();
+    if (Seq & 1)
+      return false;
+    memcpy ((void *) Snap, (void *) &AnalyseSnap, sizeof (_AnalyseSnapshot));
+    __sync_synchronize ();
+    return AnalyseSnap.Seq == Seq;
+  }
+
+int AnalyseThread (void *Parameter)
+  {
+    int Depth, Lines, Bound, i, j;
+    int Scores [SIZEARRAY (RootMoves)], Top [5];   // Top: the best Lines exact scores so far, best first
+    _RootMove rm;
+    _Perf Perf;
+    //
+    TraceThread = ttAnalyse;
+    ThreadPin ();
+    AnalyseThreadStarted = true;
+    AnalyseThreadFinished = false;
+    MovesConsidered = 0;
+    AnalyseDepthDone = 0;
+    if (PerfEnabled)
+      PerfOpen (&Perf);   // Counters are per thread, so open them here
+    else
+      PerfNone (&Perf);
+    memcpy (AnalysePerf, Perf.Count, sizeof (AnalysePerf));
+    RootMovesCount = RootMovesGet (AnalyseWhite, RootMoves);
+    for (Depth = 1; Depth <= AnalyseDepth && !AnalyseAbort; Depth++)
+      {
+        _TraceSpan Span ("Analyse Depth", Depth);
+        DepthPlay = Depth;
+        PerfStart (&Perf);
+        Lines = Min (Max (AnalyseLines, 1), SIZEARRAY (Top));
+        for (i = 0; i < RootMovesCount && !AnalyseAbort; i++)   // Best first from the last depth
+          {
+            Bound = i < Lines ? MININT : Top [Lines - 1];   // Full window until there are Lines to beat
+            if (RootMoves [i].From.x == AnalyseExact [0].x && RootMoves [i].From.y == AnalyseExact [0].y &&
+                RootMoves [i].To.x == AnalyseExact [1].x && RootMoves [i].To.y == AnalyseExact [1].y)
+              Bound = MININT;
+            Scores [i] = RootMoveScore (AnalyseWhite, &RootMoves [i], Bound);
+            for (j = Min (i, Lines); j > 0 && Top [j - 1] < Scores [i]; j--)   // Failed low: not in the Top
+              if (j < Lines)
+                Top [j] = Top [j - 1];
+            if (j < Lines)
+              Top [j] = Scores [i];
+            AnalysePublish (i + 1);
+          }
+        if (AnalyseAbort)   // Keep the last complete depth
+          break;
+        PerfStop (&Perf);
+        memcpy (AnalysePerf, Perf.Count, sizeof (AnalysePerf));
+        for (i = 0; i < RootMovesCount; i++)   // Insertion sort, best first
+          {
+            rm = RootMoves [i];
+            rm.Score = Scores [i];
+            for (j = i; j > 0 && RootMoves [j - 1].Score < rm.Score; j--)
+              RootMoves [j] = RootMoves [j - 1];
+            RootMoves [j] = rm;
+          }
+        AnalyseDepthDone = Depth;
+        AnalysePublish (RootMovesCount);
+      }
+    PerfClose (&Perf);
+    DepthPlay = DepthUser;
+    AnalyseThreadStarted = false;   // before Finished: the main loop may start the next one as soon as it sees Finished
+    __sync_synchronize ();
+    AnalyseThreadFinished = true;
+    return 0;
+  }
+
+// Start analysing the side to play, to Depth, in the background. Continuous goes on to DepthMax.
+// Exact: a move to score exactly, even if it's not among the best (NULL for none)
+void AnalyseStart (int Depth, bool Continuous, _Coord *Exact = NULL)
+  {
+    AnalyseExact [0] = AnalyseExact [1] = {-1, -1};
+    if (Exact)
+      {
+        AnalyseExact [0] = Exact [0];
+        AnalyseExact [1] = Exact [1];
+      }
+    AnalyseWhite = (MoveID & 1) ^ 1;
+    AnalyseContinuous = Continuous;
+    AnalyseDepth = Continuous ? DepthMax : Max (Depth, 1);
+    AnalyseAbort = false;
+    DepthUser = DepthPlay;
+    memcpy (BoardView, Board, sizeof (BoardView));
+    SearchStartTime = ClockMS ();
+    AnalyseThreadStarted = true;
+    StartThread (AnalyseThread, NULL);
+  }
+
+// eg "1,234,567 moves in 2.500 sec, 493,827 / sec"
+void SearchRateToStr (char **s, int Nodes, int Time)
+  {
+    IntToStr (s, Nodes, DigitsCommas);
+    StrCat (s, " moves in ");
+    IntToStrDecimals (s, Time, 3);
+    StrCat (s, " sec, ");
+    IntToStr (s, (int) ((long long) Nodes * 1000 / Max (Time, 1)), DigitsCommas);
+    StrCat (s, " / sec");
+  }
+
+void ScoreToStr (char **s, int Score)
+  {
+    if (Score >= ScoreMate)
+      StrCat (s, "Mate");
+    else
+      {
+        if (Score > 0)
+          StrCat (s, '+');
+        IntToStrDecimals (s, Score, 3);
+      }
+  }
+
+// Describe the best Lines of Snap, eg "Depth 3: 1. e2 e4 +0.250 (e7 e5)   2. ..."
+void RootMovesToStr (char **s, _AnalyseSnapshot *Snap, int Lines)
+  {
+    int i;
+    _RootMove *rm;
+    //
+    StrCat (s, Snap->White ? "\a7" : "\a0");
+    StrCat (s, "Depth ");
+    IntToStr (s, Snap->Depth);
+    StrCat (s, ':');
+    for (i = 0; i < Min (Min (Lines, Snap->Count), SIZEARRAY (Snap->Best)); i++)
+      {
+        rm = &Snap->Best [i];
+        StrCat (s, "   ");
+        IntToStr (s, i + 1);
+        StrCat (s, ". ");
+        CoordToStr (s, rm->From);
+        StrCat (s, ' ');
+        CoordToStr (s, rm->To);
+        StrCat (s, ' ');
+        ScoreToStr (s, rm->Score);
+        if (rm->Reply [0].x >= 0)
+          {
+            StrCat (s, " (");
+            CoordToStr (s, rm->Reply [0]);
+            StrCat (s, ' ');
+            CoordToStr (s, rm->Reply [1]);
+            StrCat (s, ')');
+          }
+      }
+    if (Snap->Count == 0)
+      StrCat (s, " No Moves");
+    else if (Snap->Searched < Snap->Count)   // Still going
+      {
+        StrCat (s, "   \a0[Depth ");
+        IntToStr (s, Snap->DepthNow);
+        StrCat (s, ' ');
+        IntToStr (s, Snap->Searched);
+        StrCat (s, '/');
+        IntToStr (s, Snap->Count);
+        StrCat (s, "  ");
+        SearchRateToStr (s, Snap->Nodes, Snap->Time);
+        StrCat (s, ']');
+      }
+  }
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// MATE SOLVER
+//
+// Proof-Number Search for a forced mate in MateMoves or less. The tree is kept in a fixed pool of
+// nodes, and positions are reached by moving pieces on Board [][] from the root. Disproven
+// positions are kept by PositionKey (), so a transposition isn't searched again.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+const uint32_t MateInf = 0x3FFFFFFF;   // Proof / Disproof "infinity"
+const int MateNodesMax = 1 << 21;   // Pool size, ~40MB
+
+typedef struct
+  {
+    uint32_t Proof, Disproof;   // Once proven (Proof 0), MateDistance () puts the plies to Mate in Disproof
+    int Parent;
+    int Child;   // First of Children, -1 if not expanded
+    uint16_t Children;
+    uint8_t From, To;   // Move leading here, x + 8 * y
+  } _MateNode;
+
+int MateMoves = 5;   // Mate in ...
+_MateNode *MateNodes;
+int MateNodesUsed;
+int MateHugePercent;   // of MateNodes on huge pages, -1 if unknown
+int MateTime;
+_Coord MateLine [20][2];   // Proven line From / To
+int MateLineLength;
+
+// No Mate from Key with Left plies to go, so none with fewer either. Proofs aren't kept: the line
+// shown is read from the tree's children
+typedef struct
+  {
+    uint64_t Key;
+    int Left;   // 0 if empty
+  } _MateSolved;
+
+const int MateSolvedSize = 1 << 20;   // Entries, ~16MB. Must be a power of 2
+_MateSolved *MateSolved;
+int MateSolvedHits;
+
+bool MateSolvedFind (int Ply)
+  {
+    _MateSolved *ms;
+    uint64_t Key;
+    //
+    Key = PositionKey ();
+    ms = &MateSolved [Key & (MateSolvedSize - 1)];
+    return ms->Key == Key && ms->Left >= 2 * MateMoves - Ply;
+  }
+
+void MateSolvedStore (int Ply)
+  {
+    _MateSolved *ms;
+    uint64_t Key;
+    //
+    Key = PositionKey ();
+    ms = &MateSolved [Key & (MateSolvedSize - 1)];
+    if (ms->Key != Key || ms->Left < 2 * MateMoves - Ply)
+      {
+        ms->Key = Key;
+        ms->Left = 2 * MateMoves - Ply;
+      }
+  }
+
+uint32_t MateAdd (uint32_t a, uint32_t b)
+  {
+    return Min (a + b, MateInf);
+  }
+
+// Generate the children of n, found at Ply (0 = root, the attacker to play). False if out of nodes
+bool MateExpand (int n, int Ply)
+  {
+    _RootMove Moves [256];
+    _MateNode *mn, *c;
+    _Piece OldFrom, OldTo;
+    _SpecialMove sm;
+    int Count, i, k;
+    bool White, Attacker, Check;
+    //
+    mn = &MateNodes [n];
+    if (MateSolved && Ply && MateSolvedFind (Ply))   // Disproven by another move order
+      {
+        MateSolvedHits++;
+        mn->Proof = MateInf;
+        mn->Disproof = 0;
+        return true;
+      }
+    White = (MoveID & 1) ^ 1;
+    Attacker = (Ply & 1) == 0;
+    Count = RootMovesGet (White, Moves);
+    if (Attacker && Ply == 2 * MateMoves - 2)   // Last move: only a check can mate
+      {
+        k = 0;
+        for (i = 0; i < Count; i++)
+          {
+            OldFrom = Board [Moves [i].From.x][Moves [i].From.y];
+            OldTo = Board [Moves [i].To.x][Moves [i].To.y];
+            sm = MovePiece (Moves [i].From, Moves [i].To);
+            Check = InCheck (!White);
+            UnmovePiece (Moves [i].From, Moves [i].To, OldFrom, OldTo, sm);
+            if (Check)
+              Moves [k++] = Moves [i];
+          }
+        InCheck (!White);   // Clear the King mark again
+        Count = k;
+      }
+    if (Count == 0 || (!Attacker && Ply >= 2 * MateMoves - 1))   // Nothing to look at
+      {
+        if (!Attacker && Count == 0 && InCheck (White))   // Mate
+          {
+            mn->Proof = 0;
+            mn->Disproof = MateInf;
+          }
+        else   // Stalemate, no checks or out of moves
+          {
+            mn->Proof = MateInf;
+            mn->Disproof = 0;
+          }
+        return true;
+      }
+    if (MateNodesUsed + Count > MateNodesMax)
+      return false;
+    mn->Child = MateNodesUsed;
+    mn->Children = Count;
+    for (i = 0; i < Count; i++)
+      {
+        c = &MateNodes [MateNodesUsed++];
+        c->Proof = c->Disproof = 1;
+        c->Parent = n;
+        c->Child = -1;
+        c->Children = 0;
+        c->From = Moves [i].From.x + 8 * Moves [i].From.y;
+        c->To = Moves [i].To.x + 8 * Moves [i].To.y;
+      }
+    return true;
+  }
+
+// Set n's numbers from its children. At the attacker's turn (OR) one proven child is enough,
+// at the defender's (AND) every child must be proven
+void MateUpdate (int n, int Ply)
+  {
+    _MateNode *mn, *c;
+    int i;
+    //
+    mn = &MateNodes [n];
+    if (mn->Child < 0)
+      return;
+    c = &MateNodes [mn->Child];
+    if ((Ply & 1) == 0)
+      {
+        mn->Proof = MateInf;
+        mn->Disproof = 0;
+        for (i = 0; i < mn->Children; i++, c++)
+          {
+            mn->Proof = Min (mn->Proof, c->Proof);
+            mn->Disproof = MateAdd (mn->Disproof, c->Disproof);
+          }
+      }
+    else
+      {
+        mn->Proof = 0;
+        mn->Disproof = MateInf;
+        for (i = 0; i < mn->Children; i++, c++)
+          {
+            mn->Proof = MateAdd (mn->Proof, c->Proof);
+            mn->Disproof = Min (mn->Disproof, c->Disproof);
+          }
+      }
+  }
+
+// Plies to Mate from proven node n, found at Ply, with the best play by both: the attacker takes
+// the quickest proven move (OR), the defender the longest resistance (AND). Stored in Disproof
+uint32_t MateDistance (int n, int Ply)
+  {
+    _MateNode *mn, *c;
+    uint32_t d;
+    int i;
+    bool First;
+    //
+    mn = &MateNodes [n];
+    d = 0;
+    if (mn->Child >= 0)
+      {
+        First = true;
+        c = &MateNodes [mn->Child];
+        for (i = 0; i < mn->Children; i++, c++)
+          if (c->Proof == 0)
+            {
+              if ((Ply & 1) == 0)
+                d = First ? MateDistance (c - MateNodes, Ply + 1) + 1 : Min (d, MateDistance (c - MateNodes, Ply + 1) + 1);
+              else
+                d = Max (d, MateDistance (c - MateNodes, Ply + 1) + 1);
+              First = false;
+            }
+      }
+    mn->Disproof = d;
+    return d;
+  }
+
+int MateThread (void *Parameter)
+  {
+    _Coord From [20], To [20];
+    _Piece OldFrom [20], OldTo [20];
+    _SpecialMove sm [20];
+    _MateNode *mn, *c, *Best;
+    int n, Ply, i;
+    bool OutOfNodes;
+    int64_t Start;
+    uint32_t d;
+    //
+    TraceThread = ttMate;
+    ThreadPin ();
+    MateThreadStarted = true;
+    MateThreadFinished = false;
+    MateTime = ClockMS ();
+    Start = TraceNS ();
+    MateLineLength = 0;
+    if (MateNodes == NULL)   // First time: allocated & first touched by the thread that uses it
+      MateNodes = (_MateNode *) LargeAlloc (MateNodesMax * sizeof (_MateNode));
+    if (MateSolved == NULL)
+      MateSolved = (_MateSolved *) LargeAlloc (MateSolvedSize * sizeof (_MateSolved));
+    if (MateSolved)   // Made for this position's MateMoves & Analysis
+      memset (MateSolved, 0, MateSolvedSize * sizeof (_MateSolved));
+    MateSolvedHits = 0;
+    MateNodesUsed = 0;
+    if (MateNodes)
+      {
+        MateNodesUsed = 1;
+        MateNodes [0] = {1, 1, -1, -1, 0, 0, 0};
+      }
+    OutOfNodes = MateNodes == NULL;
+    while (!OutOfNodes && MateNodes [0].Proof && MateNodes [0].Disproof && !MateAbort && !OutOfNodes)
+      {
+        // Down to the most proving node
+        n = 0;
+        Ply = 0;
+        while (MateNodes [n].Child >= 0)
+          {
+            mn = &MateNodes [n];
+            c = Best = &MateNodes [mn->Child];
+            for (i = 0; i < mn->Children; i++, c++)
+              if ((Ply & 1) == 0 ? c->Proof < Best->Proof : c->Disproof < Best->Disproof)
+                Best = c;
+            n = Best - MateNodes;
+            From [Ply] = {Best->From & 7, Best->From >> 3};
+            To [Ply] = {Best->To & 7, Best->To >> 3};
+            OldFrom [Ply] = Board [From [Ply].x][From [Ply].y];
+            OldTo [Ply] = Board [To [Ply].x][To [Ply].y];
+            sm [Ply] = MovePiece (From [Ply], To [Ply]);
+            Ply++;
+          }
+        OutOfNodes = !MateExpand (n, Ply);
+        // Back up to the root
+        while (true)
+          {
+            MateUpdate (n, Ply);
+            if (MateSolved && MateNodes [n].Disproof == 0)
+              MateSolvedStore (Ply);
+            if (n == 0)
+              break;
+            Ply--;
+            UnmovePiece (From [Ply], To [Ply], OldFrom [Ply], OldTo [Ply], sm [Ply]);
+            n = MateNodes [n].Parent;
+          }
+      }
+    if (MateNodes && MateNodes [0].Proof == 0)   // Follow the proof: quickest Mate, longest defence
+      {
+        MateDistance (0, 0);
+        n = 0;
+        Ply = 0;
+        while (MateNodes [n].Child >= 0 && MateLineLength < SIZEARRAY (MateLine))
+          {
+            mn = &MateNodes [n];
+            c = &MateNodes [mn->Child];
+            Best = NULL;
+            d = 0;
+            for (i = 0; i < mn->Children; i++, c++)
+              if (c->Proof == 0)
+                if (Best == NULL || ((Ply & 1) == 0 ? c->Disproof < d : c->Disproof > d))
+                  {
+                    Best = c;
+                    d = c->Disproof;
+                  }
+            n = Best - MateNodes;
+            Ply++;
+            MateLine [MateLineLength][0] = {Best->From & 7, Best->From >> 3};
+            MateLine [MateLineLength][1] = {Best->To & 7, Best->To >> 3};
+            MateLineLength++;
+          }
+      }
+    MateTime = ClockMS () - MateTime;
+    InCheck ((MoveID & 1) ^ 1);   // Leave the King marked correctly
+    MateHugePercent = MateNodes ? LargeHugePercent (MateNodes) : -1;
+    TraceAdd ("Mate Solve", Start, TraceNS () - Start, MateNodesUsed);   // before Finished, so the next MateThread can't share the ring
+    MateThreadStarted = false;   // before Finished: the main loop may start the next one as soon as it sees Finished
+    __sync_synchronize ();
+    MateThreadFinished = true;
+    return 0;
+  }
+
+void MateStart (void)
+  {
+    MateAbort = false;
+    memcpy (BoardView, Board, sizeof (BoardView));
+    MateThreadStarted = true;
+    StartThread (MateThread, NULL);
+  }
+
+// eg "Mate: e2 e4, e7 e5, ..." or "No Mate in 5"
+void MateToStr (char **s)
+  {
+    int i;
+    //
+    if (MateNodes == NULL)
+      {
+        StrCat (s, "No memory for the Mate solver");
+        return;
+      }
+    if (MateNodes [0].Proof == 0)
+      {
+        StrCat (s, "\ab\a1Mate\ab\a0 in ");
+        IntToStr (s, (MateLineLength + 1) / 2);
+        StrCat (s, ':');
+        for (i = 0; i < MateLineLength; i++)
+          {
+            StrCat (s, i ? ", " : " ");
+            CoordToStr (s, MateLine [i][0]);
+            StrCat (s, ' ');
+            CoordToStr (s, MateLine [i][1]);
+          }
+      }
+    else
+      {
+        if (MateNodes [0].Disproof == 0)
+          StrCat (s, "No Mate in ");
+        else
+          StrCat (s, "Gave up looking for Mate in ");
+        IntToStr (s, MateMoves);
+      }
+    StrCat (s, "   (");
+    SearchRateToStr (s, MateNodesUsed, MateTime);
+    if (MateSolvedHits)
+      {
+        StrCat (s, ", ");
+        IntToStr (s, MateSolvedHits, DigitsCommas);
+        StrCat (s, " transpositions");
+      }
+    if (PerfEnabled && MateHugePercent >= 0)
+      {
+        StrCat (s, ", ");
+        IntToStr (s, MateHugePercent);
+        StrCat (s, "% on huge pages");
+      }
+    StrCat (s, ')');
+  }
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// BENCH
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Set up Board [][] from the piece placement, side to move, castling & en passant fields of a FEN string.
+// Pieces off their home squares, and Kings & Rooks without castling rights, are marked as moved.
+// An en passant square marks its Pawn as just moved 2: then MoveID starts at 2 if White's to move
+bool BoardFromFEN (const char *FEN)
+  {
+    const char *Pieces = " kqrbnp";   // Indexed by Piece ()
+    const char *Back = "rnbqkbnr";   // Home squares
+    const char *p;
+    char Castle [8];
+    int x, y, t, n;
+    char c;
+    bool White, Moved;
+    //
+    memset (Board, 0, sizeof (Board));
+    x = 0;
+    y = 7;
+    while (*FEN && *FEN != ' ')
+      {
+        c = *FEN++;
+        if (c == '/')
+          {
+            if (x != 8 || --y < 0)
+              return false;
+            x = 0;
+          }
+        else if (c >= '1' && c <= '8')
+          x += c - '0';
+        else
+          {
+            p = strchr (Pieces, c | 0x20);   // lower case
+            if (p == NULL || c == ' ' || x > 7)
+              return false;
+            Board [x++][y] = PieceFrom (p - Pieces, c < 'a');
+          }
+        if (x > 8)
+          return false;
+      }
+    if (y != 0 || x != 8)
+      return false;
+    MoveID = (FEN [0] == ' ' && FEN [1] == 'b') ? 1 : 0;
+    while (*FEN == ' ')   // Castling rights, eg "KQkq" or "-"
+      FEN++;
+    while (*FEN && *FEN != ' ')
+      FEN++;
+    while (*FEN == ' ')
+      FEN++;
+    n = 0;
+    while (*FEN && *FEN != ' ')
+      {
+        if (n < (int) sizeof (Castle) - 1)
+          Castle [n++] = *FEN;
+        FEN++;
+      }
+    Castle [n] = 0;
+    for (y = 0; y < 8; y++)
+      for (x = 0; x < 8; x++)
+        {
+          t = Piece (Board [x][y]);
+          if (t == pEmpty)
+            continue;
+          White = PieceWhite (Board [x][y]);
+          if (t == pPawn)
+            Moved = y != (White ? 1 : 6);
+          else
+            Moved = y != (White ? 0 : 7) || Back [x] != Pieces [t];
+          if (t == pKing && !Moved)
+            Moved = strchr (Castle, White ? 'K' : 'k') == NULL && strchr (Castle, White ? 'Q' : 'q') == NULL;
+          else if (t == pRook && !Moved)
+            Moved = strchr (Castle, (x ? 'K' : 'Q') | (White ? 0 : 0x20)) == NULL;
+          if (Moved)
+            Board [x][y] = (_Piece) (Board [x][y] | pMoveID);   // as if moved on the first move
+        }
+    while (*FEN == ' ')   // En passant square, eg "e3" or "-"
+      FEN++;
+    if (FEN [0] >= 'a' && FEN [0] <= 'h' && (FEN [1] == '3' || FEN [1] == '6'))
+      {
+        x = FEN [0] - 'a';
+        y = FEN [1] == '3' ? 3 : 4;   // The Pawn that moved 2
+        if (Piece (Board [x][y]) == pPawn && PieceWhite (Board [x][y]) == (y == 3) && (MoveID & 1) == (y == 3))
+          {
+            if (MoveID == 0)   // A move before the first: the Pawn's MoveID mustn't look unmoved
+              MoveID = 2;
+            Board [x][y] = (_Piece) (PieceFrom (pPawn, y == 3) | pPawn2 | pMoveID * MoveID);
+          }
+      }
+    return true;
+  }
+
+// A fixed spread of openings, middle games & endings. Don't change them: the node total is the signature
+const char *BenchPositions [] =
+  {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "rnbqkbnr/pp1ppppp/8/2p5/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2",
+    "r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 2 3",
+    "rnbqkb1r/pp1p1ppp/4pn2/2p5/2PP4/2N5/PP2PPPP/R1BQKBNR w KQkq - 0 4",
+    "r1bqk2r/pppp1ppp/2n2n2/2b1p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 11",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "rq3rk1/ppp2ppp/1bnpb3/3N2B1/3NP3/7P/PPPQ1PP1/2KR3R w - - 7 14",
+    "r1bq1r1k/1pp1n1pp/1p1p4/4p2Q/4Pp2/1BNP4/PPP2PPP/3R1RK1 w - - 2 14",
+    "r3r1k1/2p2ppp/p1p1bn2/8/1q2P3/2NPQN2/PPP3PP/R4RK1 b - - 2 15",
+    "r1bbk1nr/pp3p1p/2n5/1N4p1/2Np1B2/8/PPP2PPP/2KR1B1R w kq - 0 13",
+    "r1bq1rk1/ppp1nppp/4n3/3p3Q/3P4/1BP1B3/PP1N2PP/R4RK1 w - - 1 16",
+    "4r1k1/r1q2ppp/ppp2n2/4P3/5Rb1/1N1BQ3/PPP3PP/R5K1 w - - 1 17",
+    "2rqkb1r/ppp2p2/2npb1p1/1N1Nn2p/2P1PP2/8/PP2B1PP/R1BQK2R b KQ - 0 11",
+    "r1bq1r1k/b1p1npp1/p2p3p/1p6/3PP3/1B2NN2/PP3PPP/R2Q1RK1 w - - 1 16",
+    "3r1rk1/p5pp/bpp1pp2/8/q1PP1P2/b3P3/P2NQRPP/1R2B1K1 b - - 6 22",
+    "r1q2rk1/2p1bppp/2Pp4/p6b/Q1PNp3/4B3/PP1R1PPP/2K4R w - - 2 18",
+    "4k2r/1pb2ppp/1p2p3/1R1p4/3P4/2r1PN2/P4PPP/1R4K1 b - - 3 22",
+    "3q2k1/pb3p1p/4pbp1/2r5/PpN2N2/1P2P2P/5PP1/Q2R2K1 b - - 4 26",
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/3N4 b - - 0 1",
+    "3b4/5kp1/1p1p1p1p/pP1PpP1P/P1P1P3/3KN3/8/8 w - - 0 1",
+    "2K5/p7/7P/5pR1/8/5k2/r7/8 w - - 0 1",
+    "8/6pk/1p6/8/PP3p1p/5P2/4KP1q/3Q4 w - - 0 1",
+    "7k/3p2pp/4q3/8/4Q3/5Kp1/P6b/8 w - - 0 1",
+    "8/2p5/8/2kPKp1p/2p4P/2P5/3P4/8 w - - 0 1",
+    "8/1p3pp1/7p/5P1P/2k3P1/8/2K2P2/8 w - - 0 1",
+    "8/pp2r1k1/2p1p3/3pP2p/1P1P1P1P/P5KR/8/8 w - - 0 1",
+    "8/3p4/p1bk3p/Pp6/1Kp1PpPp/2P2P1P/2P5/5B2 b - - 0 1",
+    "5k2/7R/4P2p/5K2/p1r2P1p/8/8/8 b - - 0 1",
+    "6k1/6p1/P6p/r1N5/5p2/7P/1b3PP1/4R1K1 w - - 0 1",
+    "1r3k2/4q3/2Pp3b/3Bp3/2Q2p2/1p1P2P1/1P2KP2/3N4 w - - 0 1",
+    "6k1/4pp1p/3p2p1/P1pPb3/R7/1r2P1PP/3B1P2/6K1 w - - 0 1",
+    "8/3p3B/5p2/5P2/p7/PP5b/k7/6K1 w - - 0 1",
+    "5rk1/q6p/2p3bR/1pPp1rP1/1P1Pp3/P3B1Q1/1K3P2/R7 w - - 93 90",
+    "4rrk1/1p1nq3/p7/2p1P1pp/3P2bp/3Q1Bn1/PPPB4/1K2R1NR w - - 40 21",
+    "r3k2r/3nnpbp/q2pp1p1/p7/Pp1PPPP1/4BNN1/1P5P/R2Q1RK1 w kq - 0 16",
+    "3Qb1k1/1r2ppb1/pN1n2q1/Pp1Pp1Pr/4P2p/4BP2/4B1R1/1R5K b - - 11 40",
+    "4k3/3q1r2/1N2r1b1/3ppN2/2nPP3/1B1R2n1/2R1Q3/3K4 w - - 5 1",
+    "r2r1n2/pp2bk2/2p1p2p/3q4/3PN1QP/2P3R1/P4PP1/5RK1 w - - 0 1",
+    "6k1/3b3r/1p1p4/p1n2p2/1PPNpP1q/P3Q1p1/1R1RB1P1/5K2 b - - 0 1",
+    "8/8/8/8/5kp1/P7/8/1K1N4 w - - 0 1",
+    "8/8/8/5N2/8/p7/8/2NK3k w - - 0 1",
+    "8/3k4/8/8/8/4B3/4KB2/2B5 w - - 0 1",
+    "8/8/1P6/5pr1/8/4R3/7k/2K5 w - - 0 1",
+    "8/2p4P/8/kr6/6R1/8/8/1K6 w - - 0 1",
+    "8/8/3P3k/8/1p6/8/1P6/1K3n2 b - - 0 1",
+    "8/R7/2q5/8/6k1/8/1P5p/K6R w - - 0 124",
+    "8/8/8/8/8/6k1/6p1/6K1 w - - 0 1",
+    "7k/7P/6K1/8/3B4/8/8/8 b - - 0 1",
+  };
+
+// "Chess bench [Depth]": search every BenchPositions at a fixed Depth with no Randomize.
+// The total moves considered is a signature: it only changes if the search does
+int Bench (int Depth)
+  {
+    char St [200], *s;
+    int i, Time, Time_;
+    long long Nodes;
+    _Perf Perf;
+    int64_t Counts [pcCount];
+    int c;
+    //
+    PerfOpen (&Perf);
+    for (c = 0; c < pcCount; c++)
+      Counts [c] = Perf.Fd [c] >= 0 ? 0 : -1;   // -1 if not available
+    DepthPlay = Depth;
+    Randomize = 0;
+    srand (1);
+    Nodes = 0;
+    Time = 0;
+    for (i = 0; i < SIZEARRAY (BenchPositions); i++)
+      {
+        if (!BoardFromFEN (BenchPositions [i]))
+          {
+            printf ("Bad FEN %d: %s\n", i + 1, BenchPositions [i]);
+            return 1;
+          }
+        InCheck ((MoveID & 1) ^ 1);   // Mark King if in check
+        MovesConsidered = 0;
+        Time_ = ClockMS ();
+        PerfStart (&Perf);
+        BestMove ((MoveID & 1) ^ 1, 0);
+        PerfStop (&Perf);
+        Time_ = ClockMS () - Time_;
+        for (c = 0; c < pcCount; c++)
+          if (Counts [c] >= 0)
+            Counts [c] += Perf.Count [c];
+        Time += Time_;
+        Nodes += MovesConsidered;
+        s = St;
+        StrCat (&s, "Position ");
+        IntToStr (&s, i + 1);
+        StrCat (&s, ": ");
+        SearchRateToStr (&s, MovesConsidered, Time_);
+        *s = 0;
+        puts (St);
+      }
+    printf ("===========================\n");
+    printf ("Depth           : %d\n", Depth);
+    printf ("Analysis        : %d\n", (int) Analysis);
+    printf ("Total time (ms) : %d\n", Time);
+    printf ("Nodes searched  : %lld\n", Nodes);
+    printf ("Nodes / second  : %lld\n", Nodes * 1000 / Max (Time, 1));
+    PerfClose (&Perf);
+    s = St;
+    PerfToStr (&s, Counts);
+    *s = 0;
+    printf ("Counters        : %s\n", St);
+    return 0;
+  }
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// BATCH EVALUATION
+//
+// Scores many positions at once, for tools (tuning, review, tests) rather than the search.
+// Positions are unpacked EvalLanes at a time into bitboards laid out by term then position, so each
+// term is one loop of shifts, ands & bit counts over the positions, that the compiler can vectorise.
+// Material (ExchangeValue, scaled by AnalysisScorePiece) plus, unless Analysis is Simple, AnalysisScoreMove per pseudo-legal move,
+// AnalysisScoreAttack (Add Moves Extended) per enemy piece attacked & AnalysisScoreAttackInd (Add Moves
+// Defend) per own piece guarded. These are the engine's terms, not its BoardScore () bit for bit.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A position in 33 bytes: a nibble per square, Piece () + 8 if White, in x + 8 * y order
+typedef struct
+  {
+    uint8_t Squares [32];
+    uint8_t BlackToMove;
+  } _PackedBoard;
+
+const int EvalLanes = 64;   // Positions unpacked & scored together
+const int EvalThreadMin = 16384;   // Batches this big are split over the CPUs
+const int EvalThreadsMax = 16;
+
+typedef struct
+  {
+    uint64_t Pieces [2][8][EvalLanes];   // Colour (White = 1) * Piece (): a bit per square
+    uint64_t Own [2][EvalLanes];
+    uint64_t All [EvalLanes];
+    uint64_t Attacks [2][EvalLanes];   // Squares each colour attacks
+    int32_t Material [EvalLanes];   // White - Black
+    int32_t Moves [EvalLanes];   // White - Black
+  } _EvalBlock;
+
+const uint64_t FileA = 0x0101010101010101ULL;
+
+void BoardPack (_Piece B [8][8], bool BlackToMove, _PackedBoard *Res)
+  {
+    int x, y, s, n;
+    //
+    memset (Res, 0, sizeof (_PackedBoard));
+    for (y = 0; y < 8; y++)
+      for (x = 0; x < 8; x++)
+        {
+          s = x + 8 * y;
+          n = Piece (B [x][y]) | (PieceWhite (B [x][y]) && Piece (B [x][y]) != pEmpty ? 8 : 0);
+          Res->Squares [s >> 1] |= n << (4 * (s & 1));
+        }
+    Res->BlackToMove = BlackToMove;
+  }
+
+void BoardUnpack (const _PackedBoard *Packed, _Piece B [8][8])
+  {
+    int x, y, s, n;
+    //
+    for (y = 0; y < 8; y++)
+      for (x = 0; x < 8; x++)
+        {
+          s = x + 8 * y;
+          n = (Packed->Squares [s >> 1] >> (4 * (s & 1))) & 15;
+          B [x][y] = (n & 7) ? PieceFrom (n & 7, n & 8) : pEmpty;
+        }
+  }
+
+inline int BitCount (uint64_t b)
+  {
+#ifdef __GNUC__
+    return __builtin_popcountll (b);
+#else
+    int n;
+    //
+    for (n = 0; b; n++)
+      b &= b - 1;
+    return n;
+#endif
+  }
+
+// Move every bit dx files & dy ranks, dropping those that leave the board
+inline uint64_t BitsShift (uint64_t b, int dx, int dy)
+  {
+    int s;
+    //
+    s = dx + 8 * dy;
+    b = s >= 0 ? b << s : b >> -s;
+    if (dx > 0)
+      b &= ~(FileA * ((1 << dx) - 1));   // wrapped onto the A side
+    else if (dx < 0)
+      b &= ~(FileA * (((1 << -dx) - 1) << (8 + dx)));   // wrapped onto the H side
+    return b;
+  }
+
+void EvalUnpack (_EvalBlock *eb, const _PackedBoard *Boards, int n)
+  {
+    int i, s, p;
+    //
+    memset (eb->Pieces, 0, sizeof (eb->Pieces));
+    for (i = 0; i < n; i++)
+      for (s = 0; s < 64; s++)
+        {
+          p = (Boards [i].Squares [s >> 1] >> (4 * (s & 1))) & 15;
+          eb->Pieces [p >> 3][p & 7][i] |= (uint64_t) 1 << s;
+        }
+    for (i = 0; i < n; i++)
+      {
+        eb->Own [0][i] = eb->Own [1][i] = 0;
+        for (p = pKing; p <= pPawn; p++)
+          {
+            eb->Own [0][i] |= eb->Pieces [0][p][i];
+            eb->Own [1][i] |= eb->Pieces [1][p][i];
+          }
+        eb->All [i] = eb->Own [0][i] | eb->Own [1][i];
+      }
+  }
+
+const int EvalPieceScale = 100;   // AnalysisScorePiece is a percentage of ExchangeValue: 100 scores pieces at that
+
+void EvalMaterial (_EvalBlock *eb, int n)
+  {
+    int i, p, Value;
+    //
+    for (i = 0; i < n; i++)
+      eb->Material [i] = 0;
+    for (p = pQueen; p <= pPawn; p++)   // Kings always balance
+      {
+        Value = (int) ((int64_t) ExchangeValue [p] * AnalysisScorePiece / EvalPieceScale);
+        for (i = 0; i < n; i++)
+          eb->Material [i] += Value * (BitCount (eb->Pieces [1][p][i]) - BitCount (eb->Pieces [0][p][i]));
+      }
+  }
+
+// Moves of every piece, each direction in one pass. Shifts don't merge pieces & rays stop at
+// the first piece, so the bit counts are exact move counts (castling & En-Passant aside).
+// Attacks [] gathers the squares reached, own pieces included
+void EvalMoves (_EvalBlock *eb, int n)
+  {
+    static const int Jump [8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+    static const int Ray [8][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}, {1, 1}, {1, -1}, {-1, 1}, {-1, -1}};   // Straight then Diagonal
+    uint64_t Fill [EvalLanes], Reach [EvalLanes];
+    int i, d, c, k, Sign, Fwd;
+    uint64_t *p, *Own, *Other, *Att;
+    //
+    for (i = 0; i < n; i++)
+      eb->Moves [i] = 0;
+    for (c = 0; c <= 1; c++)
+      {
+        Sign = c ? 1 : -1;
+        Fwd = c ? 1 : -1;
+        Own = eb->Own [c];
+        Other = eb->Own [!c];
+        Att = eb->Attacks [c];
+        for (i = 0; i < n; i++)
+          Att [i] = 0;
+        for (d = 0; d < 8; d++)
+          {
+            p = eb->Pieces [c][pKnight];
+            for (i = 0; i < n; i++)
+              {
+                Reach [i] = BitsShift (p [i], Jump [d][0], Jump [d][1]);
+                Att [i] |= Reach [i];
+                eb->Moves [i] += Sign * BitCount (Reach [i] & ~Own [i]);
+              }
+            p = eb->Pieces [c][pKing];
+            for (i = 0; i < n; i++)
+              {
+                Reach [i] = BitsShift (p [i], Ray [d][0], Ray [d][1]);
+                Att [i] |= Reach [i];
+                eb->Moves [i] += Sign * BitCount (Reach [i] & ~Own [i]);
+              }
+            for (i = 0; i < n; i++)   // Queens & Rooks or Bishops
+              {
+                Fill [i] = eb->Pieces [c][pQueen][i] | eb->Pieces [c][d < 4 ? pRook : pBishop][i];
+                Reach [i] = 0;
+              }
+            for (k = 0; k < 7; k++)
+              for (i = 0; i < n; i++)
+                {
+                  Fill [i] = BitsShift (Fill [i], Ray [d][0], Ray [d][1]);
+                  Reach [i] |= Fill [i];
+                  Fill [i] &= ~eb->All [i];
+                }
+            for (i = 0; i < n; i++)
+              {
+                Att [i] |= Reach [i];
+                eb->Moves [i] += Sign * BitCount (Reach [i] & ~Own [i]);
+              }
+          }
+        p = eb->Pieces [c][pPawn];
+        for (i = 0; i < n; i++)
+          {
+            Fill [i] = BitsShift (p [i], 0, Fwd) & ~eb->All [i];   // One forward
+            Reach [i] = BitsShift (Fill [i] & (c ? 0xff0000ULL : 0xff0000000000ULL), 0, Fwd) & ~eb->All [i];   // Two from the start
+            eb->Moves [i] += Sign * (BitCount (Fill [i]) + BitCount (Reach [i]));
+            Reach [i] = BitsShift (p [i], 1, Fwd);   // Captures
+            Att [i] |= Reach [i];
+            eb->Moves [i] += Sign * BitCount (Reach [i] & Other [i]);
+            Reach [i] = BitsShift (p [i], -1, Fwd);
+            Att [i] |= Reach [i];
+            eb->Moves [i] += Sign * BitCount (Reach [i] & Other [i]);
+          }
+      }
+  }
+
+// Score n <= EvalLanes positions for the side to move
+void EvalBlock (_EvalBlock *eb, const _PackedBoard *Boards, int n, int *Scores)
+  {
+    int i, Term;
+    bool Moves;
+    //
+    Moves = (int) Analysis > 0 && (AnalysisScoreMove || AnalysisScoreAttack || AnalysisScoreAttackInd);
+    EvalUnpack (eb, Boards, n);
+    EvalMaterial (eb, n);
+    if (Moves)
+      EvalMoves (eb, n);
+    for (i = 0; i < n; i++)
+      {
+        Term = 0;
+        if (Moves)
+          {
+            Term = eb->Moves [i] * AnalysisScoreMove;
+            if ((int) Analysis >= 2)   // Add Moves Extended: attacks
+              Term += AnalysisScoreAttack * (BitCount (eb->Attacks [1][i] & eb->Own [0][i]) - BitCount (eb->Attacks [0][i] & eb->Own [1][i]));
+            if ((int) Analysis >= 3)   // Add Moves Defend: guards
+              Term += AnalysisScoreAttackInd * (BitCount (eb->Attacks [1][i] & eb->Own [1][i] & ~eb->Pieces [1][pKing][i]) -
+                                                BitCount (eb->Attacks [0][i] & eb->Own [0][i] & ~eb->Pieces [0][pKing][i]));
+          }
+        Scores [i] = eb->Material [i] + Term;
+        if (Boards [i].BlackToMove)
+          Scores [i] = -Scores [i];
+      }
+  }
+
+typedef struct
+  {
+    const _PackedBoard *Boards;
+    int Count;
+    int *Scores;
+    volatile bool Done;
+  } _EvalJob;
+
+int EvalThread (void *Parameter)
+  {
+    _EvalJob *j = (_EvalJob *) Parameter;
+    _EvalBlock *eb;
+    int i;
+    //
+    eb = (_EvalBlock *) malloc (sizeof (_EvalBlock));
+    for (i = 0; i < j->Count; i += EvalLanes)
+      EvalBlock (eb, j->Boards + i, Min (EvalLanes, j->Count - i), j->Scores + i);
+    free (eb);
+    j->Done = true;
+    return 0;
+  }
+
+// Score Count positions, each for its side to move, into Scores []. Big batches use all the CPUs
+void EvaluateBatch (const _PackedBoard *Boards, int Count, int *Scores)
+  {
+    _EvalJob Jobs [EvalThreadsMax];
+    int Threads, i, Per;
+    //
+    Threads = 1;
+    if (Count >= EvalThreadMin)
+      {
+        Threads = 4;
+#ifdef __linux__
+        Threads = Min (Max ((int) sysconf (_SC_NPROCESSORS_ONLN), 1), EvalThreadsMax);
+#endif
+      }
+    Per = (Count / Threads + EvalLanes - 1) / EvalLanes * EvalLanes;   // Whole blocks each
+    for (i = 0; i < Threads; i++)
+      {
+        Jobs [i].Boards = Boards + Min (i * Per, Count);
+        Jobs [i].Count = Max (Min (Per, Count - i * Per), 0);
+        Jobs [i].Scores = Scores + Min (i * Per, Count);
+        Jobs [i].Done = false;
+        if (i == Threads - 1)
+          Jobs [i].Count = Max (Count - i * Per, 0);
+      }
+    for (i = 1; i < Threads; i++)
+      StartThread (EvalThread, &Jobs [i]);
+    EvalThread (&Jobs [0]);
+    for (i = 1; i < Threads; i++)
+      while (!Jobs [i].Done)
+        usleep (100);
+  }
+
+void EvalRateShow (const char *Name, int Count, int Time)
+  {
+    printf ("%s: %d positions in %d ms, %lld / second\n", Name, Count, Time, (long long) Count * 1000 / Max (Time, 1));
+  }
+
+const int EvalBenchTolerance = 500;   // bench-eval fails if a batch score is further than this (half a Pawn) from BoardScore ()
+
+// bench-eval: batch scoring of the Bench positions against Board by Board BoardScore (), position by position.
+// Returns 1 if any differs by more than EvalBenchTolerance, so a tuning run can't drift from the engine
+int BenchEval (int Count, int Analysis_)
+  {
+    _PackedBoard *Boards;
+    int *Scores, *Expected;
+    int i, n, Time, Differ, DiffMax, Over;
+    //
+    if (Count <= 0)
+      {
+        printf ("bench-eval: the count of positions must be 1 or more\n");
+        return 1;
+      }
+    Analysis = (_Analysis) Analysis_;
+    n = SIZEARRAY (BenchPositions);
+    Boards = (_PackedBoard *) malloc (Count * sizeof (_PackedBoard));
+    Scores = (int *) malloc (Count * sizeof (int));
+    Expected = (int *) malloc (Count * sizeof (int));
+    for (i = 0; i < n && i < Count; i++)
+      {
+        if (!BoardFromFEN (BenchPositions [i]))
+          {
+            printf ("Bad FEN %d: %s\n", i + 1, BenchPositions [i]);
+            free (Boards);
+            free (Scores);
+            free (Expected);
+            return 1;
+          }
+        BoardPack (Board, MoveID & 1, &Boards [i]);
+      }
+    for (; i < Count; i++)
+      Boards [i] = Boards [i % n];
+    printf ("Analysis %d, Score / Piece %d, Move %d, Attack %d, Attack' %d\n", Analysis_,
+            AnalysisScorePiece, AnalysisScoreMove, AnalysisScoreAttack, AnalysisScoreAttackInd);
+    Time = ClockMS ();
+    for (i = 0; i < Count; i++)
+      {
+        BoardUnpack (&Boards [i], Board);
+        Expected [i] = BoardScore (!Boards [i].BlackToMove);
+      }
+    Time = ClockMS () - Time;
+    EvalRateShow ("BoardScore ()   ", Count, Time);
+    Time = ClockMS ();
+    EvaluateBatch (Boards, Count, Scores);
+    EvalRateShow ("EvaluateBatch ()", Count, ClockMS () - Time);
+    Differ = DiffMax = Over = 0;
+    for (i = 0; i < Min (n, Count); i++)   // The rest are copies
+      if (Scores [i] != Expected [i])
+        {
+          Differ++;
+          DiffMax = Max (DiffMax, abs (Scores [i] - Expected [i]));
+          if (abs (Scores [i] - Expected [i]) > EvalBenchTolerance)
+            {
+              Over++;
+              printf ("Position %d: EvaluateBatch () %d, BoardScore () %d\n", i + 1, Scores [i], Expected [i]);
+            }
+        }
+    printf ("EvaluateBatch () against BoardScore (): %d of %d positions differ, by up to %d. %d over the tolerance of %d\n",
+            Differ, Min (n, Count), DiffMax, Over, EvalBenchTolerance);
+    free (Boards);
+    free (Scores);
+    free (Expected);
+    return Over ? 1 : 0;
+  }
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// MOVE LOG
+//
+// The Log is a list of moves & messages, grouped into rows (a White move and the Black reply share
+// a row). Rows are formatted when first shown and kept, so a new move only formats its own row.
+// _LogView draws just the rows that fit, so long games cost no more to draw than short.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+  {
+    _Coord From;
+    _Coord To;
+    int MoveID;   // MoveID before the move. -1 for a message
+    bool Capture;
+    bool Special;   // Castle, En-Passant or Crown
+    char *Note;   // Text after the move, or the message. NULL if none
+  } _LogItem;
+
+typedef struct
+  {
+    int Item;   // First LogItems [] in this row
+    char *Text;   // Formatted row, NULL until needed
+  } _LogRow;
+
+_LogItem *LogItems;
+int LogCount, LogSize;
+
+_LogRow *LogRows;
+int LogRowCount, LogRowSize;
+
+bool LogChanged;   // The view needs an Update ()
+int LogMark = -1;   // LogItems [] shown as the Board's position, when there are moves after it
+int LogClicked = -1;   // LogItems [] clicked in the view, for the Main Loop
+
+void LogRowInvalidate (int Row)
+  {
+    if (Row >= 0 && Row < LogRowCount)
+      {
+        free (LogRows [Row].Text);
+        LogRows [Row].Text = NULL;
+      }
+    LogChanged = true;
+  }
+
+// Add an item, starting a new row unless it's a Black move answering the White move alone in the last row
+_LogItem *LogAdd (int MoveID, char *Note)
+  {
+    _LogItem *li;
+    _LogRow *lr;
+    //
+    if (LogCount == LogSize)
+      {
+        LogSize = LogSize ? 2 * LogSize : 256;
+        LogItems = (_LogItem *) realloc (LogItems, LogSize * sizeof (_LogItem));
+      }
+    li = &LogItems [LogCount];
+    memset (li, 0, sizeof (_LogItem));
+    li->MoveID = MoveID;
+    StrAssignCopy (&li->Note, Note);
+    if (LogRowCount && MoveID >= 0 && (MoveID & 1) &&
+        LogRows [LogRowCount - 1].Item == LogCount - 1 && LogItems [LogCount - 1].MoveID == MoveID - 1)
+      LogRowInvalidate (LogRowCount - 1);
+    else
+      {
+        if (LogRowCount == LogRowSize)
+          {
+            LogRowSize = LogRowSize ? 2 * LogRowSize : 128;
+            LogRows = (_LogRow *) realloc (LogRows, LogRowSize * sizeof (_LogRow));
+          }
+        lr = &LogRows [LogRowCount++];
+        lr->Item = LogCount;
+        lr->Text = NULL;
+      }
+    LogCount++;
+    LogChanged = true;
+    return li;
+  }
+
+void LogMove (_Coord From, _Coord To, int MoveID, bool Capture, bool Special, char *Note)
+  {
+    _LogItem *li;
+    //
+    li = LogAdd (MoveID, Note);
+    li->From = From;
+    li->To = To;
+    li->Capture = Capture;
+    li->Special = Special;
+  }
+
+void LogMessage (const char *Message)
+  {
+    LogAdd (-1, (char *) Message);
+    Refresh = true;
+  }
+
+// Drop items from Count on: a new move after Undo
+void LogTruncate (int Count)
+  {
+    if (Count >= LogCount)
+      return;
+    if (LogMark >= Count)
+      LogMark = -1;
+    while (LogCount > Count)
+      free (LogItems [--LogCount].Note);
+    while (LogRowCount && LogRows [LogRowCount - 1].Item >= LogCount)
+      free (LogRows [--LogRowCount].Text);
+    LogRowInvalidate (LogRowCount - 1);
+  }
+
+void LogClear (void)
+  {
+    LogTruncate (0);
+  }
+
+// Row holding LogItems [Item]
+int LogItemRow (int Item)
+  {
+    int Lo, Hi, Mid;
+    //
+    Lo = 0;
+    Hi = LogRowCount - 1;
+    while (Lo < Hi)
+      {
+        Mid = (Lo + Hi + 1) / 2;
+        if (LogRows [Mid].Item <= Item)
+          Lo = Mid;
+        else
+          Hi = Mid - 1;
+      }
+    return Lo;
+  }
+
+// Replace the note after LogItems [Item]
+void LogNoteSet (int Item, char *Note)
+  {
+    if (Item >= 0 && Item < LogCount)
+      {
+        StrAssignCopy (&LogItems [Item].Note, Note);
+        LogRowInvalidate (LogItemRow (Item));
+      }
+  }
+
+void LogMarkSet (int Item)
+  {
+    if (Item != LogMark)
+      {
+        if (LogMark >= 0)
+          LogRowInvalidate (LogItemRow (LogMark));
+        LogMark = Item;
+        if (LogMark >= 0)
+          LogRowInvalidate (LogItemRow (LogMark));
+      }
+  }
+
+int LogItemToStr (char *s, _LogItem *li)
+  {
+    char *s_;
+    //
+    s_ = s;
+    if (li->MoveID < 0)
+      StrCat (&s, li->Note);
+    else
+      {
+        if ((li->MoveID & 1) == 0)   // White move
+          {
+            StrCat (&s, "\a8");
+            NumToStr (&s, (li->MoveID >> 1) + 1);
+            StrCat (&s, ".  \a7");
+          }
+        else
+          StrCat (&s, "\a0");
+        CoordToStr (&s, li->From);
+        if (li->Capture)
+          StrCat (&s, "\abx\ab");   // show an x
+        else
+          StrCat (&s, ' ');
+        CoordToStr (&s, li->To);
+        if (li->Special)
+          StrCat (&s, '*');
+        if (li->Note)
+          StrCat (&s, li->Note);
+      }
+    *s = 0;
+    return s - s_;
+  }
+
+// Length of LogItemToStr () text, for sizing buffers
+int LogItemLength (_LogItem *li)
+  {
+    return (li->Note ? StrLen (li->Note) : 0) + 32;
+  }
+
+char *LogRowText (int Row)
+  {
+    _LogRow *lr;
+    int i, End, Len;
+    char *s;
+    //
+    lr = &LogRows [Row];
+    if (lr->Text == NULL)
+      {
+        End = Row + 1 < LogRowCount ? LogRows [Row + 1].Item : LogCount;
+        Len = 1;
+        for (i = lr->Item; i < End; i++)
+          Len += LogItemLength (&LogItems [i]) + 1;
+        lr->Text = (char *) malloc (Len);
+        s = lr->Text;
+        for (i = lr->Item; i < End; i++)
+          {
+            if (i > lr->Item)
+              StrCat (&s, '\v');
+            s += LogItemToStr (s, &LogItems [i]);
+            if (i == LogMark)
+              StrCat (&s, "  \ab<<\ab");
+          }
+        *s = 0;
+      }
+    return lr->Text;
+  }
+
+// The Log up to LogItems [Count] as text, rows ending '\n'. Caller frees
+char *LogText (int Count)
+  {
+    int Row, i, Len;
+    char *Res, *s;
+    //
+    Count = Min (Count, LogCount);
+    Len = 1;
+    for (i = 0; i < Count; i++)
+      Len += LogItemLength (&LogItems [i]) + 1;
+    Res = (char *) malloc (Len);
+    s = Res;
+    Row = 0;
+    for (i = 0; i < Count; i++)
+      {
+        if (i > 0)
+          if (Row + 1 < LogRowCount && LogRows [Row + 1].Item == i)
+            {
+              StrCat (&s, '\n');
+              Row++;
+            }
+          else
+            StrCat (&s, '\v');
+        s += LogItemToStr (s, &LogItems [i]);
+      }
+    if (Count)
+      StrCat (&s, '\n');
+    *s = 0;
+    return Res;
+  }
+
+bool LogSquare (char **s, _Coord *c)
+  {
+    if ((*s) [0] >= 'a' && (*s) [0] <= 'h' && (*s) [1] >= '1' && (*s) [1] <= '8')
+      {
+        c->x = (*s) [0] - 'a';
+        c->y = (*s) [1] - '1';
+        *s += 2;
+        return true;
+      }
+    return false;
+  }
+
+void LogSkipFormats (char **s)
+  {
+    while ((*s) [0] == '\a' && (*s) [1])
+      *s += 2;
+  }
+
+// Rebuild the Log from LogText () (or an older save's Logs). Anything that isn't a move is a message
+void LogParse (char *Text)
+  {
+    char *Line, *Seg, *End, *s, *p;
+    int MoveID, n;
+    _Coord From, To;
+    bool Capture, Special, Ok;
+    //
+    MoveID = 1;   // A Black move with nothing before it
+    Line = Text;
+    while (*Line)
+      {
+        End = StrPos (Line, '\n');
+        if (End)
+          *End = 0;
+        Seg = Line;
+        while (Seg)
+          {
+            s = StrPos (Seg, '\v');
+            if (s)
+              *s++ = 0;
+            if (*Seg)
+              {
+                Ok = false;
+                p = Seg;
+                LogSkipFormats (&p);
+                n = -1;
+                if (*p >= '1' && *p <= '9')   // White move number
+                  {
+                    n = StrGetNum (&p);
+                    while (*p == '.' || *p == ' ')
+                      p++;
+                    LogSkipFormats (&p);
+                  }
+                if (LogSquare (&p, &From))
+                  {
+                    Capture = false;
+                    if (*p == ' ')
+                      p++;
+                    else
+                      {
+                        LogSkipFormats (&p);
+                        Capture = *p == 'x';
+                        if (Capture)
+                          p++;
+                        LogSkipFormats (&p);
+                      }
+                    if (LogSquare (&p, &To))
+                      {
+                        Special = *p == '*';
+                        if (Special)
+                          p++;
+                        if (n > 0)
+                          MoveID = 2 * (n - 1);
+                        else if ((MoveID & 1) == 0)
+                          MoveID++;
+                        LogMove (From, To, MoveID, Capture, Special, *p ? p : NULL);
+                        MoveID++;
+                        Ok = true;
+                      }
+                  }
+                if (!Ok)
+                  LogMessage (Seg);
+              }
+            Seg = s;
+          }
+        if (End == NULL)
+          break;
+        Line = End + 1;
+      }
+  }
+
+class _LogView: public _Label
+  {
+    public:
+      int Scroll;   // Rows hidden below the bottom (0 shows the latest)
+      bool Dragging;
+      int DragY, DragScroll;
+      //
+      _LogView (_Container *Parent, _Rect Rect);
+      void DrawCustom (void);
+      bool ProcessEventCustom (_Event *Event, _Point Offset);
+      int RowHeight (void);
+      void Update (void);
+  };
+
+_LogView::_LogView (_Container *Parent, _Rect Rect) : _Label (Parent, Rect, NULL, aLeft, bNone)
+  {
+    Scroll = 0;
+    Dragging = false;
+  }
+
+// Row pitch. The rows are drawn this far apart, so a click maps back to the row drawn there
+int _LogView::RowHeight (void)
+  {
+    return Max (Font->Size + Font->Size / 4, 1);
+  }
+
+// The Label draws the background. Rows go up from the bottom, LogRowCount - Scroll - 1 first
+void _LogView::DrawCustom (void)
+  {
+    int Row, y;
+    //
+    _Label::DrawCustom ();
+    y = Rect.Height - RowHeight ();
+    for (Row = LogRowCount - Scroll - 1; Row >= 0 && y > -RowHeight (); Row--)
+      {
+        TextOutAligned ({0, y, Rect.Width, RowHeight ()}, LogRowText (Row), aLeft, aCenter);
+        y -= RowHeight ();
+      }
+  }
+
+// Redraw, if anything changed
+void _LogView::Update (void)
+  {
+    if (!LogChanged)
+      return;
+    LogChanged = false;
+    if (Scroll > LogRowCount - 1)
+      Scroll = Max (LogRowCount - 1, 0);
+    Invalidate (true);
+  }
+
+// Drag up & down to scroll through the Log. Click a row to go to its last move
+bool _LogView::ProcessEventCustom (_Event *Event, _Point Offset)
+  {
+    int s, Row, i, End;
+    //
+    if (Event->Type == etMouseDown && Event->Key == KeyMouseLeft && IsEventMine (Event, Offset))
+      {
+        Dragging = true;
+        DragY = Event->Y;
+        DragScroll = Scroll;
+        return true;
+      }
+    if (Dragging)
+      if (Event->Type == etMouseMove)
+        {
+          s = DragScroll + (Event->Y - DragY) / RowHeight ();
+          s = Min (Max (s, 0), Max (LogRowCount - 1, 0));
+          if (s != Scroll)
+            {
+              Scroll = s;
+              LogChanged = true;
+              Refresh = true;
+            }
+          return true;
+        }
+      else if (Event->Type == etMouseUp)
+        {
+          Dragging = false;
+          if (Scroll == DragScroll && abs (Event->Y - DragY) < RowHeight () / 2)   // A click, not a drag
+            {
+              Row = LogRowCount - Scroll - 1 - (Offset.y + Rect.Height - Event->Y) / RowHeight ();
+              if (Row >= 0 && Row < LogRowCount)
+                {
+                  End = Row + 1 < LogRowCount ? LogRows [Row + 1].Item : LogCount;
+                  for (i = End - 1; i >= LogRows [Row].Item; i--)
+                    if (LogItems [i].MoveID >= 0)
+                      {
+                        LogClicked = i;
+                        break;
+                      }
+                }
+            }
+          return true;
+        }
+    return false;
+  }
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// GLOBALS
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class _FormMain: public _Form
+  {
+    public:
+      const int BoardWidth = 500;
+      _Piece Graveyard [2][64];
+      int ColourBG [2];
+      //
+      _Container *Toolbar;
+      _Button *bProperties, *bUndo, *bPlay, *bRestart, *bEdit, *bHelp, *bQuit;
+      _Label *lMessage;
+      _Label *lGraveyard;
+      _ChessBoard *cBoard;
+      _LogView *lLogs;
+      _Label *lPCStats;
+      //
+      _Wait *Wait;
+      _MenuPopup *Menu;
+      _MenuPopup *mPieces;
+      //
+      _FormMain (char *Title);
+     ~_FormMain ();
+  };
+
+_FormMain *fMain;
+
+bool PCPlays;
+
+bool Undo;
+bool Redo;
+bool PCPlay;
+bool Analyse;
+bool Restart;
+bool Review;
+bool Mate;
+
+char *Path;
+
+typedef struct
+  {
+    _Coord From;
+    _Coord To;
+    _Piece OldFrom;
+    _Piece OldTo;
+    _SpecialMove SpecMov;
+    int Log;   // LogCount before the move
+  } _UndoItem;
+
+_UndoItem UndoStack [1000];
+
+int UndoStackSize;
+int UndoStackTop;   // Moves from UndoStackSize to here can be Redone
+
+// Every SnapshotPlies the position is kept, so any ply is a copy & at most SnapshotPlies - 1 moves away
+const int SnapshotPlies = 16;
+
+typedef struct
+  {
+    _Piece Board [8][8];
+    _Piece Graveyard [2][64];
+    int MoveID;
+  } _Snapshot;
+
+_Snapshot Snapshots [SIZEARRAY (UndoStack) / SnapshotPlies + 1];   // [i] is the position at ply i * SnapshotPlies
+int SnapshotCount;
+
+// LogItems [] up to the Board's position: Redo moves are left out
+int LogEnd (void)
+  {
+    if (UndoStackSize < UndoStackTop)
+      return UndoStack [UndoStackSize].Log;
+    return LogCount;
+  }
+
+// The Board is the start of a new game: nothing to Undo or Redo
+void UndoClear (void)
+  {
+    LogTruncate (LogEnd ());
+    LogMarkSet (-1);
+    UndoStackSize = 0;
+    UndoStackTop = 0;
+    SnapshotCount = 0;
+  }
+
+int StrChangeChar (char *p, char c1, char c2)
+  {
+    int n;
+    //
+    n = 0;
+    while (*p)
+      {
+        if (*p == c1)
+          {
+            *p = c2;
+            n++;
+          }
+        p++;
+      }
+    return n;
+  }
+
+char *RemoveTextFormats (char *St)
+  {
+    char *Res, *r;
+    //
+    Res = NULL;
+    StrAssignCopy (&Res, St);
+    r = Res;
+    while (true)
+      {
+        r = StrPos (r, '\a');
+        if (r == NULL)
+          break;
+        StrDelete (r, 2);
+      }
+    r = Res;
+    while (true)
+      {
+        r = StrPos (r, '\v');
+        if (r == NULL)
+          break;
+        *r = tab;
+      }
+    return Res;
+  }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Journal: every move & undo is appended to FileJournal as it happens, so a crash loses nothing.
+// Records: 'N' new game (MoveID, PlayerWhite, PCPlays, Board, Graveyard, Log), 'M' move (From, To), 'U' undo,
+// 'J' jump to a ply (int32)
+
+#define FileJournal ".ChessJournal"
+
+const int JournalSyncMS = 1000;   // Longest a record waits for fsync (power cuts). Process crashes lose nothing
+
+FILE *Journal;
+bool JournalReplaying;   // Recovering: don't write what's being read
+bool JournalUnsynced;
+int JournalSyncTime;
+
+void JournalWrite (const void *Data, int Size)
+  {
+    if (Journal && !JournalReplaying)
+      {
+        fwrite (Data, 1, Size, Journal);
+        JournalUnsynced = true;
+      }
+  }
+
+// Push written records to the disk, at most every JournalSyncMS. Force for now
+void JournalSync (bool Force)
+  {
+    if (Journal && JournalUnsynced && (Force || ClockMS () - JournalSyncTime >= JournalSyncMS))
+      {
+        fflush (Journal);
+#ifdef _WIN32
+        _commit (_fileno (Journal));
+#else
+        fsync (fileno (Journal));
+#endif
+        JournalUnsynced = false;
+        JournalSyncTime = ClockMS ();
+      }
+  }
+
+// Start the journal again from the Board as it is now
+void JournalNewGame (void)
+  {
+    char Path [PathMax];
+    char *Log;
+    int32_t n;
+    uint8_t b;
+    //
+    if (JournalReplaying)
+      return;
+    if (Journal)
+      fclose (Journal);
+    HomePath (Path, FileJournal);
+    Journal = fopen (Path, "wb");   // The old game's done with
+    b = 'N';
+    JournalWrite (&b, 1);
+    n = MoveID;
+    JournalWrite (&n, sizeof (n));
+    b = PlayerWhite;
+    JournalWrite (&b, 1);
+    b = PCPlays;
+    JournalWrite (&b, 1);
+    JournalWrite (Board, sizeof (Board));
+    JournalWrite (fMain->Graveyard, sizeof (fMain->Graveyard));
+    Log = LogText (LogEnd ());
+    n = StrLen (Log);
+    JournalWrite (&n, sizeof (n));
+    JournalWrite (Log, n);
+    free (Log);
+    if (Journal)
+      fflush (Journal);
+  }
+
+void JournalMove (_Coord From, _Coord To)
+  {
+    uint8_t Rec [3] = {'M', (uint8_t) (From.x + 8 * From.y), (uint8_t) (To.x + 8 * To.y)};
+    //
+    JournalWrite (Rec, sizeof (Rec));
+    if (Journal)
+      fflush (Journal);
+  }
+
+void JournalUndo (void)
+  {
+    JournalWrite ("U", 1);
+    if (Journal)
+      fflush (Journal);
+  }
+
+void JournalJump (int Ply)
+  {
+    uint8_t b;
+    int32_t n;
+    //
+    b = 'J';
+    n = Ply;
+    JournalWrite (&b, 1);
+    JournalWrite (&n, sizeof (n));
+    if (Journal)
+      fflush (Journal);
+  }
+
+bool FileWriteLine_ (int f, char *Line)
+  {
+    bool Res;
+    //
+    StrChangeChar (Line, '\n', ',');
+    Res = FileWriteLine (f, Line);
+    StrChangeChar (Line, ',', '\n');
+    return Res;
+  }
+
+void GameSave (char *Name, void *Parameter)
+  {
+    _TraceSpan Span ("GameSave");
+    int f;   // file ID
+    char *Line, *l, *Log;
+    int x, y;
+    _Piece *p;
+    //
+    Log = LogText (LogEnd ());
+    Line = (char *) malloc (StrLen (Log) + 1000);
+    f = FileOpen (Name, foWrite);
+    if (f >= 0)
+      {
+        l = Line;
+        StrCat (&l, "Board\t");
+        for (y = 0; y < 8; y++)
+          for (x = 0; x < 8; x++)
+            {
+              NumToStrBase (&l, Board [x][y], 0, 16);
+              StrCat (&l, ',');
+            }
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "PlayerWhite\t");
+        NumToStr (&l, PlayerWhite);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "Graveyard\t");
+        for (y = 0; y <= 1; y++)
+          {
+            p = fMain->Graveyard [y];
+            while (*p != pEmpty)
+              {
+                NumToHex (&l, *p++);
+                StrCat (&l, ',');
+              }
+            StrCat (&l, '\t');
+          }
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "Logs\t");
+        StrCat (&l, Log);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "Moves\t");
+        NumToStr (&l, MoveID);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        FileClose (f);
+      }
+    else
+      LogMessage ("*** ERROR SAVING FILE ***");
+    free (Line);
+    free (Log);
+  }
+
+void LogSave (char *Name, void *Parameter)
+  {
+    int f;   // file ID
+    char *l, *Log;
+    //
+    f = FileOpen (Name, foWrite);
+    if (f >= 0)
+      {
+        Log = LogText (LogEnd ());
+        l = RemoveTextFormats (Log);
+        FileWrite (f, (byte *) l, StrLen (l));
+        FileClose (f);
+        free (l);
+        free (Log);
+      }
+    else
+      LogMessage ("*** ERROR SAVING FILE ***");
+  }
+
+#define FileSettings ".Chess"
+
+bool SettingsSave (void)
+  {
+    int f;   // file ID
+    char *Line, *l;
+    //
+    Line = (char *) malloc (250);
+    f = FileOpen_ (FileSettings, foWrite);
+    if (f >= 0)
+      {
+        l = Line;
+        StrCat (&l, "Depth\t");
+        IntToStr (&l, DepthPlay);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "Analysis\t");
+        IntToStr (&l, Analysis);
+        StrCat (&l, '\t');
+        IntToStr (&l, AnalysisScorePiece);
+        StrCat (&l, '\t');
+        IntToStr (&l, AnalysisScoreMove);
+        StrCat (&l, '\t');
+        IntToStr (&l, AnalysisScoreAttack);
+        StrCat (&l, '\t');
+        IntToStr (&l, AnalysisScoreAttackInd);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "Randomize\t");
+        IntToStr (&l, Randomize);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "Cache\t");
+        IntToStr (&l, CacheEnabled);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        if (PinCPU >= 0)   // Not pinned unless it says so
+          {
+            l = Line;
+            StrCat (&l, "Pin\t");
+            IntToStr (&l, PinCPU);
+            *l = 0;
+            FileWriteLine_ (f, Line);
+          }
+        //
+        l = Line;
+        StrCat (&l, "Perf\t");
+        IntToStr (&l, PerfEnabled);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "Lines\t");
+        IntToStr (&l, AnalyseLines);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "Mate\t");
+        IntToStr (&l, MateMoves);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "Font\t");
+        StrCat (&l, FontPieces);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "FontMap\t");
+        IntToStr (&l, FontPiecesMap);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        //
+        l = Line;
+        StrCat (&l, "Control\t");
+        IntToStr (&l, fMain->cBoard->ControlShow);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        // Colours
+        l = Line;
+        StrCat (&l, "Colours\t");
+        NumToHex (&l, fMain->cBoard->Colours [0]); StrCat (&l, ',');
+        NumToHex (&l, fMain->cBoard->Colours [1]); StrCat (&l, ',');
+        NumToHex (&l, fMain->ColourBG [0]); StrCat (&l, ',');
+        NumToHex (&l, fMain->ColourBG [1]);
+        *l = 0;
+        FileWriteLine_ (f, Line);
+        // Done Close file & exit
+        FileClose (f);
+      }
+    free (Line);
+    return f >= 0;
+  }
+
+int Colours [4];
+
+bool SettingsLoad (void)
+  {
+    int f;   // file ID
+    int Size;
+    char *Data, *dp, *dp_;
+    _DirItem *d;
+    int i;
+    //
+    for (i = 0; i < SIZEARRAY (Colours); i++)
+      Colours [i] = -1;
+    f = FileOpen_ (FileSettings, foRead);
+    if (f >= 0)
+      {
+        Size = FileSize (f);
+        Data = (char *) malloc (Size + 1);
+        Data [Size] = 0;   // Terminate String
+        FileRead (f, (byte *) Data, Size);
+        dp = Data;
+        while (*dp)
+          {
+            // Break off a line
+            dp_ = StrPos (dp, '\n');
+            *dp_++ = 0;
+            // Look for a Data Name
+            if (StrMatch (&dp, "Depth\t"))
+              DepthPlay = StrGetNum (&dp);
+            else if (StrMatch (&dp, "Analysis\t"))
+              {
+                if (*dp)
+                  Analysis = (_Analysis) StrGetNum (&dp);
+                if (*dp)
+                  AnalysisScorePiece = StrGetNum (&dp);
+                if (*dp)
+                  AnalysisScoreMove = StrGetNum (&dp);
+                if (*dp)
+                  AnalysisScoreAttack = StrGetNum (&dp);
+                if (*dp)
+                  AnalysisScoreAttackInd = StrGetNum (&dp);
+              }
+            else if (StrMatch (&dp, "Randomize\t"))
+              Randomize = StrGetNum (&dp);
+            else if (StrMatch (&dp, "Cache\t"))
+              CacheEnabled = StrGetNum (&dp);
+            else if (StrMatch (&dp, "Mate\t"))
+              MateMoves = Min (Max (StrGetNum (&dp), 1), SIZEARRAY (MateLine) / 2);
+            else if (StrMatch (&dp, "Pin\t"))
+              PinCPU = Max (StrGetNum (&dp), -1);
+            else if (StrMatch (&dp, "Perf\t"))
+              PerfEnabled = StrGetNum (&dp);
+            else if (StrMatch (&dp, "Lines\t"))
+              AnalyseLines = Min (Max (StrGetNum (&dp), 0), SIZEARRAY (fMain->cBoard->Hints));
+            else if (StrMatch (&dp, "Font\t"))
+              {
+                // find font in Fonts
+                d = Fonts;
+                FontPiecesSelect = 0;
+                while (d)
+                  if (StrSame (d->Name, dp))   // Font found
+                    {
+                      FontPieces = d->Name;
+                      d = NULL;
+                    }
+                  else
+                    {
+                      d = d->Next;
+                      FontPiecesSelect++;
+                    }
+              }
+            else if (StrMatch (&dp, "FontMap\t"))
+              FontPiecesMap = StrGetNum (&dp);
+            else if (StrMatch (&dp, "Control\t"))
+              fMain->cBoard->ControlShow = StrGetNum (&dp);
+            else if (StrMatch (&dp, "Colours\t"))
+              {
+                for (i = 0; i < SIZEARRAY (Colours); i++)
+                  {
+                    Colours [i] = StrGetHex (&dp);
+                    if (dp)
+                      dp++;
+                  }
+              }
+            else
+              DebugError ("Properties File: Bad Item: ", dp);
+            dp = dp_;
+          }
+        FileClose (f);
+        free (Data);
+        return true;
+      }
+    return false;
+  }
+
+void GraveyardUpdate (void)
+  {
+    int c;
+    _Piece *p;
+    char St [256], *s;
+    //
+    s = St;
+    for (c = 0; c <= 1; c++)   // Go through both "sides" of the Graveyard
+      {
+        p = fMain->Graveyard [c];
+        while (*p != pEmpty)
+          PieceToChar (&s, *p++);
+        if (!c)
+          StrCat (&s, '\n');
+      }
+    *s = 0;
+    if (fMain->lGraveyard->Font)
+      fMain->lGraveyard->FontSet (FontPieces, fMain->lGraveyard->Font->Size);
+    fMain->lGraveyard->TextSet (St);
+  }
+
+void GraveyardAddPiece (_Piece Piece)
+  {
+    _Piece *p;
+    //
+    p = fMain->Graveyard [PieceWhite (Piece)];   // Appropriate Graveyard "side"
+    while (*p != pEmpty)
+      p++;
+    *p++ = Piece;
+    *p = pEmpty;
+    Refresh = true;
+  }
+
+void GraveyardRemovePiece (_Piece Piece)
+  {
+    _Piece *p, *q;
+    //
+    p = fMain->Graveyard [PieceWhite (Piece)];   // Select Grave "side"
+    q = NULL;
+    while (*p != pEmpty)   // Find end
+      {
+        q = p;   // note last item (this will be deleted)
+        p++;
+      }
+    if (q)   // Is there an item here
+      *q = pEmpty;   // delete it
+    Refresh = true;
+  }
+
+// The Board changed ply: show where it is in the Log
+void UndoMarkUpdate (void)
+  {
+    if (UndoStackSize > 0 && UndoStackSize < UndoStackTop)
+      LogMarkSet (UndoStack [UndoStackSize - 1].Log);
+    else
+      LogMarkSet (-1);
+  }
+
+void MovePiece_ (_Coord From, _Coord To)
+  {
+    _UndoItem *ui;
+    bool Redo;
+    _Snapshot *ss;
+    //
+    ui = &UndoStack [UndoStackSize];
+    Redo = UndoStackSize < UndoStackTop &&
+           ui->From.x == From.x && ui->From.y == From.y && ui->To.x == To.x && ui->To.y == To.y;
+    if (!Redo && UndoStackSize < UndoStackTop)   // A new line: forget what followed
+      {
+        LogTruncate (ui->Log);
+        UndoStackTop = UndoStackSize;
+        SnapshotCount = Min (SnapshotCount, UndoStackSize / SnapshotPlies + 1);
+      }
+    if (UndoStackSize % SnapshotPlies == 0 && UndoStackSize / SnapshotPlies == SnapshotCount)
+      {
+        ss = &Snapshots [SnapshotCount++];
+        memcpy (ss->Board, Board, sizeof (Board));
+        memcpy (ss->Graveyard, fMain->Graveyard, sizeof (fMain->Graveyard));
+        ss->MoveID = MoveID;
+      }
+    ui->From = From;
+    ui->To = To;
+    ui->OldFrom = Board [From.x][From.y];
+    ui->OldTo = Board [To.x][To.y];
+    fMain->cBoard->HintsCount = 0;
+    //
+    if (Piece (ui->OldTo) != pEmpty)   // taking piece
+      GraveyardAddPiece (ui->OldTo);   // Add to Graveyard
+    ui->SpecMov = MovePiece (From, To);
+    JournalMove (From, To);
+    if (ui->SpecMov == smEnPassant)
+      GraveyardAddPiece (PieceFrom (pPawn, !PieceWhite (ui->OldFrom)));
+    if (!Redo)
+      {
+        ui->Log = LogCount;
+        LogMove (From, To, MoveID - 1, Piece (ui->OldTo) != pEmpty, ui->SpecMov != smNone, NULL);   // MovePiece () has moved MoveID on
+        fMain->lLogs->Scroll = 0;   // Show the new move
+      }
+    //
+    if (UndoStackSize  + 1 < SIZEARRAY (UndoStack))   // just in case
+      UndoStackSize++;
+    UndoStackTop = Max (UndoStackTop, UndoStackSize);
+    UndoMarkUpdate ();
+  }
+
+// Take back the last move. It stays in UndoStack (and the Log) to Redo
+bool UnmovePiece_ (void)
+  {
+    _UndoItem *ui;
+    //
+    if (UndoStackSize == 0)
+      return false;
+    UndoStackSize--;
+    ui = &UndoStack [UndoStackSize];
+    UnmovePiece (ui->From, ui->To, ui->OldFrom, ui->OldTo, ui->SpecMov);
+    JournalUndo ();
+    fMain->cBoard->HintsCount = 0;
+    if (Piece (ui->OldTo) != pEmpty)   // replacing taken piece
+      GraveyardRemovePiece (ui->OldTo);
+    if (ui->SpecMov == smEnPassant)
+      GraveyardRemovePiece (PieceFrom (pPawn, !PieceWhite (ui->OldFrom)));
+    UndoMarkUpdate ();
+    return true;
+  }
+
+bool RedoPiece_ (void)
+  {
+    if (UndoStackSize >= UndoStackTop)
+      return false;
+    MovePiece_ (UndoStack [UndoStackSize].From, UndoStack [UndoStackSize].To);
+    return true;
+  }
+
+// Go to any ply from 0 to UndoStackTop: step there if it's near, else from the nearest Snapshot before it
+void GameJump (int Ply)
+  {
+    _Snapshot *ss;
+    int i;
+    bool Replaying;
+    //
+    if (Ply < 0 || Ply > UndoStackTop || Ply == UndoStackSize)
+      return;
+    Replaying = JournalReplaying;
+    JournalReplaying = true;   // Journal the jump, not every step of it
+    i = Min (Ply / SnapshotPlies, SnapshotCount - 1);
+    if (Ply < UndoStackSize && (i < 0 || UndoStackSize - Ply <= Ply - i * SnapshotPlies))
+      while (UndoStackSize > Ply)
+        UnmovePiece_ ();
+    else if (i >= 0 && (Ply < UndoStackSize || Ply - UndoStackSize > Ply - i * SnapshotPlies))
+      {
+        ss = &Snapshots [i];
+        memcpy (Board, ss->Board, sizeof (Board));
+        memcpy (fMain->Graveyard, ss->Graveyard, sizeof (fMain->Graveyard));
+        MoveID = ss->MoveID;
+        UndoStackSize = i * SnapshotPlies;
+      }
+    while (UndoStackSize < Ply)
+      RedoPiece_ ();
+    JournalReplaying = Replaying;
+    JournalJump (Ply);
+    UndoMarkUpdate ();
+    fMain->cBoard->HintsCount = 0;
+    fMain->cBoard->Move [0][0].x = -1;
+    fMain->cBoard->Move [1][0].x = -1;
+    Refresh = true;
+  }
+
+// The ply after LogItems [Item], or -1 if it isn't a move in UndoStack
+int LogItemPly (int Item)
+  {
+    int Lo, Hi, Mid;
+    //
+    Lo = 0;
+    Hi = UndoStackTop - 1;
+    while (Lo <= Hi)   // UndoStack [].Log only goes up
+      {
+        Mid = (Lo + Hi) / 2;
+        if (UndoStack [Mid].Log == Item)
+          return Mid + 1;
+        if (UndoStack [Mid].Log < Item)
+          Lo = Mid + 1;
+        else
+          Hi = Mid - 1;
+      }
+    return -1;
+  }
+
+// The move doesn't leave the mover's King in Check
+bool MoveSafe (_Coord From, _Coord To)
+  {
+    _Piece OldFrom, OldTo;
+    _SpecialMove sm;
+    bool Res;
+    //
+    OldFrom = Board [From.x][From.y];
+    OldTo = Board [To.x][To.y];
+    sm = MovePiece (From, To);
+    Res = !InCheck (MoveID & 1);
+    UnmovePiece (From, To, OldFrom, OldTo, sm);
+    return Res;
+  }
+
+// Rebuild UndoStack by replaying the Log's moves from BoardInit (), as Redo moves so the Log stays as it is.
+// False, with the Board put back & nothing to Undo, if the Log isn't from move 1 or doesn't end at the Board
+bool GameReplayLog (void)
+  {
+    _Piece BoardSave [8][8], GraveyardSave [2][64];
+    int MoveIDSave, Plies, i, x, y;
+    _Piece p, q;
+    _UndoItem *ui;
+    bool Res, Replaying;
+    //
+    Plies = 0;
+    for (i = 0; i < LogCount; i++)
+      if (LogItems [i].MoveID >= 0)
+        {
+          if (LogItems [i].MoveID != Plies || Plies + 1 >= SIZEARRAY (UndoStack))   // Not from move 1, or too long
+            return false;
+          ui = &UndoStack [Plies++];
+          ui->From = LogItems [i].From;
+          ui->To = LogItems [i].To;
+          ui->Log = i;
+        }
+    if (Plies == 0)
+      return false;
+    memcpy (BoardSave, Board, sizeof (Board));
+    memcpy (GraveyardSave, fMain->Graveyard, sizeof (GraveyardSave));
+    MoveIDSave = MoveID;
+    Replaying = JournalReplaying;
+    JournalReplaying = true;   // The caller journals the result
+    BoardInit ();
+    fMain->Graveyard [0][0] = fMain->Graveyard [1][0] = pEmpty;
+    UndoStackSize = 0;
+    UndoStackTop = Plies;
+    SnapshotCount = 0;
+    Res = true;
+    while (Res && UndoStackSize < Plies)
+      {
+        ui = &UndoStack [UndoStackSize];
+        p = Board [ui->From.x][ui->From.y];
+        Res = Piece (p) != pEmpty && PieceWhite (p) == !(MoveID & 1) && MoveValid (ui->From, ui->To) && MoveSafe (ui->From, ui->To);
+        if (Res)
+          RedoPiece_ ();
+      }
+    for (x = 0; x < 8 && Res; x++)   // Same pieces where the file left them
+      for (y = 0; y < 8 && Res; y++)
+        {
+          p = Board [x][y];
+          q = BoardSave [x][y];
+          Res = Piece (p) == Piece (q) && (Piece (p) == pEmpty || PieceWhite (p) == PieceWhite (q));
+        }
+    if (!Res || MoveID != MoveIDSave)
+      {
+        memcpy (Board, BoardSave, sizeof (Board));
+        memcpy (fMain->Graveyard, GraveyardSave, sizeof (GraveyardSave));
+        MoveID = MoveIDSave;
+        UndoStackSize = UndoStackTop = 0;
+        SnapshotCount = 0;
+        Res = false;
+      }
+    JournalReplaying = Replaying;
+    UndoMarkUpdate ();
+    return Res;
+  }
+
+void GameLoad (char *Name, void *Parameter)
+  {
+    _TraceSpan Span ("GameLoad");
+    int f;   // file ID
+    int Size;
+    char *Data, *dp, *dp_;
+    int x, y;
+    _Piece *p;
+    int n;
+    //
+    f = FileOpen (Name, foRead);
+    if (f >= 0)
+      {
+        UndoClear ();
+        fMain->Graveyard [0][0] = fMain->Graveyard [1][0] = pEmpty;
+        Size = FileSize (f);
+        Data = (char *) malloc (Size + 1);
+        FileRead (f, (byte *) Data, Size);
+        Data [Size] = 0;   // Terminate String
+        dp = Data;
+        while (*dp)
+          {
+            // Break off a line
+            dp_ = StrPos (dp, '\n');
+            *dp_++ = 0;
+            // Look for a Data Name
+            if (StrMatch (&dp, "Board\t"))
+              {
+                x = y = 0;
+                while (true)
+                  {
+                    if (*dp == 0)
+                      break;
+                    Board [x][y] = (_Piece) StrGetHex (&dp);
+                    dp++;
+                    if (++x == 8)
+                      {
+                        x = 0;
+                        if (++y == 8)
+                          break;
+                      }
+                  }
+              }
+            else if (StrMatch (&dp, "PlayerWhite\t"))
+              PlayerWhite = StrGetNum (&dp);
+            else if (StrMatch (&dp, "Graveyard\t"))
+              {
+                p = fMain->Graveyard [0];
+                n = 0;
+                while (*dp && n < SIZEARRAY (fMain->Graveyard [0]))
+                  {
+                    if (*dp == '\t')
+                      {
+                        p = fMain->Graveyard [1];
+                        n = 0;
+                        dp++;
+                      }
+                    if (*dp)
+                      {
+                        p [n++] = (_Piece) StrGetHex (&dp);
+                        p [n] = pEmpty;
+                      }
+                    if (*dp == ',')
+                      dp++;
+                  }
+              }
+            else if (StrMatch (&dp, "Logs\t"))
+              {
+                StrChangeChar (dp, ',', '\n');
+                LogClear ();
+                LogParse (dp);
+              }
+            else if (StrMatch (&dp, "Moves\t"))
+              MoveID = StrGetNum (&dp);
+            else
+              break;
+            dp = dp_;
+          }
+        FileClose (f);
+        free (Data);
+        fMain->cBoard->Move [0][0].x = -1;
+        fMain->cBoard->Move [1][0].x = -1;
+        fMain->cBoard->HintsCount = 0;
+        fMain->lMessage->TextSet (NULL);
+        fMain->lMessage->VisibleSet (false);
+        if (!GameReplayLog ())   // No Undo then: the loaded Board is the start
+          UndoClear ();
+        Refresh = true;
+        JournalNewGame ();
+      }
+    else
+      LogMessage ("*** ERROR LOADING FILE ***");
+  }
+
+// Put back the game in FileJournal, then carry on appending to it. False if there's nothing to recover
+bool JournalRecover (void)
+  {
+    char Path [PathMax];
+    FILE *f;
+    uint8_t b, PC, Rec [2];
+    int32_t n, MoveIDStart;
+    _Piece BoardStart [8][8];
+    char *Log;
+    bool Res;
+    //
+    Res = false;
+    Log = NULL;
+    HomePath (Path, FileJournal);
+    f = fopen (Path, "rb");
+    if (f)
+      {
+        if (fread (&b, 1, 1, f) == 1 && b == 'N' &&
+            fread (&MoveIDStart, sizeof (MoveIDStart), 1, f) == 1 &&
+            fread (&b, 1, 1, f) == 1 &&
+            fread (&PC, 1, 1, f) == 1 &&
+            fread (BoardStart, sizeof (BoardStart), 1, f) == 1 &&
+            fread (fMain->Graveyard, sizeof (fMain->Graveyard), 1, f) == 1 &&
+            fread (&n, sizeof (n), 1, f) == 1 && n >= 0 && n < (1 << 26) &&
+            (Log = (char *) malloc (n + 1)) != NULL && (int) fread (Log, 1, n, f) == n)
+          {
+            Log [n] = 0;
+            LogClear ();
+            LogParse (Log);
+            JournalReplaying = true;
+            PlayerWhite = b;
+            PCPlays = PC;
+            memcpy (Board, BoardStart, sizeof (Board));
+            MoveID = MoveIDStart;
+            UndoClear ();
+            while (fread (&b, 1, 1, f) == 1)   // A torn last record just ends it
+              if (b == 'M' && fread (Rec, 1, 2, f) == 2)
+                MovePiece_ ({Rec [0] & 7, Rec [0] >> 3}, {Rec [1] & 7, Rec [1] >> 3});
+              else if (b == 'U')
+                UnmovePiece_ ();
+              else if (b == 'J' && fread (&n, sizeof (n), 1, f) == 1)
+                GameJump (n);
+              else
+                break;
+            JournalReplaying = false;
+            GraveyardUpdate ();
+            Refresh = true;
+            Res = true;
+          }
+        else
+          fMain->Graveyard [0][0] = fMain->Graveyard [1][0] = pEmpty;
+        free (Log);
+        fclose (f);
+      }
+    if (Res)
+      Journal = fopen (Path, "ab");
+    return Res;
+  }
+
+bool PrevPlayer (void)
+  {
+    _UndoItem *ui;
+    //
+    ui = &UndoStack [UndoStackSize];
+    return PieceWhite (ui->OldFrom);
+  }
+
+bool MoveOposite (_UndoItem *m1, _UndoItem *m2)
+  {
+    if (m1->From.x == m2->To.x && m1->From.y == m2->To.y)
+      if (m1->To.x == m2->From.x && m1->To.y == m2->From.y)
+        return true;
+    return false;
+  }
+
+bool CheckRepeat (void)
+  {
+    if (NoDraws)
+      if (UndoStackSize >= 4)
+        if (MoveOposite (&UndoStack [UndoStackSize-1], &UndoStack [UndoStackSize-3]))
+          if (MoveOposite (&UndoStack [UndoStackSize-2], &UndoStack [UndoStackSize-4]))
+            {
+              MoveForbidenFrom = UndoStack [UndoStackSize-4].From;
+              MoveForbidenTo = UndoStack [UndoStackSize-4].To;
+              return true;
+            }
+    MoveForbidenFrom = {-1, -1};
+    MoveForbidenTo = {-1, -1};
+    return false;
+  }
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// GAME DATABASE
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Files in the home directory, the first two append-only:
+//   FileGames: magic, then per game: uint16 Plies, uint8 Result, uint8 Flags, [32 byte Board if dfBoard], uint16 Move * Plies
+//   FileGamesAdded: magic, then a _DbEntry for every position of every game added since the index was sorted
+//   FileGamesIndex: _DbIndexHead, then the _DbEntry's of every other game, sorted by Key
+// A Move is From.x + 8 * From.y + 64 * (To.x + 8 * To.y). Crowning is always to a Queen.
+// DbLoad () merges FileGamesAdded into the index, so it's sorted once per batch of new games rather than
+// on every load, then maps it: finding a position is a binary search that only reads the pages it
+// touches. Games added while running also go in DbIndex [], with an unsorted tail
+
+#define FileGames ".ChessGames"
+#define FileGamesAdded ".ChessGames.new"
+#define FileGamesIndex ".ChessGames.idx"
+
+const char DbMagic [8] = "Chess1G";
+const char DbIndexMagic [8] = "Chess1I";   // FileGamesAdded
+const char DbIndexSortedMagic [8] = "Chess1S";
+
+enum _DbResult {drUnknown, drWhite, drBlack, drDraw};
+
+const int dfBoard = 1;   // Game doesn't start from BoardInit (): the Board follows
+const int dfBlack = 2;   // Black to play first
+
+const uint16_t DbMoveNone = 0xFFFF;   // No move from the game's final position
+
+typedef struct
+  {
+    uint64_t Key;    // PositionKey ()
+    uint32_t Game;   // Offset in FileGames
+    uint16_t Move;   // played from here, or DbMoveNone
+    uint8_t Result;
+    uint8_t Spare;
+  } _DbEntry;
+
+bool DatabaseAdd;      // Main Loop requests
+bool DatabaseImport;
+bool DatabaseShow;
+
+typedef struct
+  {
+    char Magic [8];   // DbIndexSortedMagic
+    uint32_t Games;
+    uint32_t Spare;   // Keeps the entries 8 byte aligned
+  } _DbIndexHead;
+
+_DbEntry *DbIndex;   // Games added since DbLoad ()
+int DbIndexCount, DbIndexSorted, DbIndexSize;
+const _DbEntry *DbMap;   // FileGamesIndex: mapped on Linux, read elsewhere
+int DbMapCount, DbMapGames;
+size_t DbMapBytes;
+int DbGames;
+bool DbLoaded;
+
+int DbEntryCompare (const void *a, const void *b)
+  {
+    uint64_t ka = ((_DbEntry *) a)->Key, kb = ((_DbEntry *) b)->Key;
+    //
+    return ka < kb ? -1 : ka > kb;
+  }
+
+void DbSort (void)
+  {
+    qsort (DbIndex, DbIndexCount, sizeof (_DbEntry), DbEntryCompare);
+    DbIndexSorted = DbIndexCount;
+  }
+
+void DbIndexAdd (_DbEntry *e)
+  {
+    if (DbIndexCount == DbIndexSize)
+      {
+        DbIndexSize = Max (DbIndexSize * 2, 1 << 16);
+        DbIndex = (_DbEntry *) realloc (DbIndex, DbIndexSize * sizeof (_DbEntry));
+      }
+    DbIndex [DbIndexCount++] = *e;
+  }
+
+// Add the entries of FileGamesAdded to DbIndex []. False if there's none
+bool DbEntriesRead (const char *Path)
+  {
+    char Magic [8];
+    FILE *f;
+    _DbEntry e;
+    bool Res;
+    //
+    Res = false;
+    f = fopen (Path, "rb");
+    if (f)
+      {
+        if (fread (Magic, 1, sizeof (Magic), f) == sizeof (Magic) && memcmp (Magic, DbIndexMagic, sizeof (Magic)) == 0)
+          {
+            Res = true;
+            while (fread (&e, sizeof (e), 1, f) == 1)
+              DbIndexAdd (&e);
+          }
+        fclose (f);
+      }
+    return Res;
+  }
+
+// Map a sorted index file onto DbMap. False if there's none
+bool DbMapIndex (const char *Path)
+  {
+    _DbIndexHead Head;
+    FILE *f;
+    void *p;
+    bool Res;
+    //
+    DbMap = NULL;
+    DbMapCount = DbMapGames = 0;
+    f = fopen (Path, "rb");
+    if (f == NULL)
+      return false;
+    Res = fread (&Head, sizeof (Head), 1, f) == 1 && memcmp (Head.Magic, DbIndexSortedMagic, sizeof (Head.Magic)) == 0;
+    fseek (f, 0, SEEK_END);
+    DbMapBytes = ftell (f);
+    if (Res && DbMapBytes > sizeof (Head))
+      {
+#ifdef __linux__
+        p = mmap (NULL, DbMapBytes, PROT_READ, MAP_SHARED, fileno (f), 0);   // Stays when f is closed
+        Res = p != MAP_FAILED;
+        if (Res)
+          {
+            madvise (p, DbMapBytes, MADV_RANDOM);   // Binary searches: no read ahead
+            DbMap = (const _DbEntry *) ((char *) p + sizeof (Head));
+          }
+#else
+        p = malloc (DbMapBytes);
+        fseek (f, 0, SEEK_SET);
+        Res = fread (p, 1, DbMapBytes, f) == DbMapBytes;
+        if (Res)
+          DbMap = (const _DbEntry *) ((char *) p + sizeof (Head));
+        else
+          free (p);
+#endif
+        if (Res)
+          {
+            DbMapCount = (DbMapBytes - sizeof (Head)) / sizeof (_DbEntry);
+            DbMapGames = Head.Games;
+          }
+      }
+    fclose (f);
+    return Res;
+  }
+
+void DbUnmapIndex (void)
+  {
+    if (DbMap)
+#ifdef __linux__
+      munmap ((char *) DbMap - sizeof (_DbIndexHead), DbMapBytes);
+#else
+      free ((char *) DbMap - sizeof (_DbIndexHead));
+#endif
+    DbMap = NULL;
+    DbMapCount = 0;
+  }
+
+// Merge DbIndex [] with DbMap [] into a new sorted index file, then put it in place of Path. Unmaps DbMap
+bool DbMerge (const char *Path)
+  {
+    char Temp [PathMax + 8];
+    _DbIndexHead Head;
+    FILE *f;
+    int i, j;
+    bool Res;
+    //
+    DbSort ();
+    memset (&Head, 0, sizeof (Head));
+    memcpy (Head.Magic, DbIndexSortedMagic, sizeof (Head.Magic));
+    Head.Games = DbMapGames;
+    for (i = 0; i < DbIndexCount; i++)
+      if (DbIndex [i].Move == DbMoveNone)   // One per game
+        Head.Games++;
+    snprintf (Temp, sizeof (Temp), "%s.tmp", Path);
+    f = fopen (Temp, "wb");
+    if (f == NULL)
+      return false;
+    Res = fwrite (&Head, sizeof (Head), 1, f) == 1;
+    i = j = 0;
+    while (Res && (i < DbMapCount || j < DbIndexCount))
+      if (j == DbIndexCount || (i < DbMapCount && DbMap [i].Key <= DbIndex [j].Key))
+        Res = fwrite (&DbMap [i++], sizeof (_DbEntry), 1, f) == 1;
+      else
+        Res = fwrite (&DbIndex [j++], sizeof (_DbEntry), 1, f) == 1;
+    Res = fclose (f) == 0 && Res;
+    DbUnmapIndex ();
+#ifdef _WIN32
+    if (Res)
+      remove (Path);   // rename () won't replace it
+#endif
+    if (Res)
+      Res = rename (Temp, Path) == 0;
+    else
+      remove (Temp);
+    return Res;
+  }
+
+// Open the index on first use, sorting in any games added since last time
+void DbLoad (void)
+  {
+    char Path [PathMax], Added [PathMax];
+    int i;
+    //
+    if (DbLoaded)
+      return;
+    DbLoaded = true;
+    HomePath (Path, FileGamesIndex);
+    HomePath (Added, FileGamesAdded);
+    DbEntriesRead (Added);
+    DbMapIndex (Path);
+    if (DbIndexCount)   // Games added since it was sorted
+      {
+        if (DbMerge (Path))
+          {
+            remove (Added);
+            DbIndexCount = DbIndexSorted = 0;
+          }
+        DbMapIndex (Path);   // The merged index, or else the old one again: DbMerge () unmapped it
+      }
+    DbSort ();   // If the merge failed the added games stay in DbIndex []
+    DbGames = DbMapGames;
+    for (i = 0; i < DbIndexCount; i++)
+      if (DbIndex [i].Move == DbMoveNone)
+        DbGames++;
+  }
+
+// Open for append, writing Magic if it's new
+FILE *DbAppendOpen (const char *Name, const char *Magic)
+  {
+    char Path [PathMax];
+    FILE *f;
+    //
+    HomePath (Path, Name);
+    f = fopen (Path, "ab");
+    if (f && ftell (f) == 0)
+      fwrite (Magic, 1, 8, f);
+    return f;
+  }
+
+// Open both Database files to add games. False if either fails: then neither is open
+bool DbFilesOpen (FILE **fg, FILE **fi)
+  {
+    *fg = DbAppendOpen (FileGames, DbMagic);
+    *fi = DbAppendOpen (FileGamesAdded, DbIndexMagic);
+    if (*fg && *fi)
+      return true;
+    if (*fg)
+      fclose (*fg);
+    if (*fi)
+      fclose (*fi);
+    return false;
+  }
+
+void DbFilesClose (FILE *fg, FILE *fi)
+  {
+    fclose (fg);
+    fclose (fi);
+  }
+
+// Write a game played from Start (NULL = BoardInit ()) to the open files & the index.
+// Entries [Plies + 1] have Key & Move set: the position before each move, and at the end
+void DbWrite (FILE *fg, FILE *fi, _Piece Start [8][8], bool BlackFirst, int Plies, _DbEntry *Entries, _DbResult Result)
+  {
+    uint8_t Head [4], Packed [32];
+    int i, x, y;
+    _Piece p;
+    //
+    Head [0] = Plies & 0xFF;
+    Head [1] = Plies >> 8;
+    Head [2] = Result;
+    Head [3] = (Start ? dfBoard : 0) | (BlackFirst ? dfBlack : 0);
+    for (i = 0; i <= Plies; i++)
+      {
+        Entries [i].Game = ftell (fg);
+        Entries [i].Result = Result;
+        Entries [i].Spare = 0;
+      }
+    fwrite (Head, 1, sizeof (Head), fg);
+    if (Start)
+      {
+        memset (Packed, 0, sizeof (Packed));
+        for (y = 0; y < 8; y++)
+          for (x = 0; x < 8; x++)
+            {
+              p = Start [x][y];
+              Packed [(x + 8 * y) / 2] |= (Piece (p) | (PieceWhite (p) && Piece (p) != pEmpty ? 8 : 0)) << ((x & 1) * 4);
+            }
+        fwrite (Packed, 1, sizeof (Packed), fg);
+      }
+    for (i = 0; i < Plies; i++)
+      fwrite (&Entries [i].Move, sizeof (uint16_t), 1, fg);   // Little-endian hosts
+    fwrite (Entries, sizeof (_DbEntry), Plies + 1, fi);
+    for (i = 0; i <= Plies; i++)
+      DbIndexAdd (&Entries [i]);
+    DbGames++;
+    if (DbIndexCount - DbIndexSorted > Max (1 << 14, DbIndexSorted / 4))   // Keep the unsorted tail short, but not sort too often
+      DbSort ();
+  }
+
+// Result of the game on Board [][] with White to play or not
+_DbResult DbResult (bool White)
+  {
+    _RootMove Moves [256];
+    //
+    if (RootMovesGet (White, Moves))
+      return drUnknown;
+    if (InCheck (White))
+      return White ? drBlack : drWhite;
+    return drDraw;   // Stalemate
+  }
+
+// Add a game played from Start (NULL = BoardInit ()). Uses Board [][], but puts it back.
+// Result drUnknown looks for mate / stalemate at the end. False if a move isn't legal: then nothing is added
+bool DbAdd (_Piece Start [8][8], bool BlackFirst, int Plies, _Coord Moves [][2], _DbResult Result = drUnknown)
+  {
+    _Piece BoardSave [8][8];
+    int MoveIDSave, i;
+    _DbEntry *Entries;
+    bool White, Res;
+    _Piece p;
+    FILE *fg, *fi;
+    //
+    DbLoad ();
+    memcpy (BoardSave, Board, sizeof (Board));
+    MoveIDSave = MoveID;
+    if (Start)
+      {
+        memcpy (Board, Start, sizeof (Board));
+        MoveID = BlackFirst ? 1 : 0;
+      }
+    else
+      BoardInit ();
+    Entries = (_DbEntry *) malloc ((Plies + 1) * sizeof (_DbEntry));
+    Res = true;
+    for (i = 0; i <= Plies; i++)
+      {
+        White = (MoveID & 1) ^ 1;
+        Entries [i].Key = PositionKey ();
+        Entries [i].Move = DbMoveNone;
+        if (i == Plies)
+          break;
+        p = Board [Moves [i][0].x][Moves [i][0].y];
+        if (Piece (p) == pEmpty || PieceWhite (p) != White || !MoveValid (Moves [i][0], Moves [i][1]))
+          {
+            Res = false;
+            break;
+          }
+        MovePiece (Moves [i][0], Moves [i][1]);
+        if (InCheck (White))   // Left the King in check
+          {
+            Res = false;
+            break;
+          }
+        Entries [i].Move = Moves [i][0].x + 8 * Moves [i][0].y + 64 * (Moves [i][1].x + 8 * Moves [i][1].y);
+      }
+    if (Res)
+      {
+        if (Result == drUnknown)
+          Result = DbResult (White);
+        Res = DbFilesOpen (&fg, &fi);
+        if (Res)
+          {
+            DbWrite (fg, fi, Start, BlackFirst, Plies, Entries, Result);
+            DbFilesClose (fg, fi);
+          }
+      }
+    free (Entries);
+    memcpy (Board, BoardSave, sizeof (Board));
+    MoveID = MoveIDSave;
+    return Res;
+  }
+
+// Add the game so far, from UndoStack
+bool DbAddGame (void)
+  {
+    _Piece BoardSave [8][8], Start [8][8];
+    _Coord Moves [SIZEARRAY (UndoStack)][2];
+    int MoveIDSave, i;
+    _UndoItem *ui;
+    bool Res;
+    //
+    memcpy (BoardSave, Board, sizeof (Board));
+    MoveIDSave = MoveID;
+    for (i = UndoStackSize - 1; i >= 0; i--)   // Back to the start
+      {
+        ui = &UndoStack [i];
+        UnmovePiece (ui->From, ui->To, ui->OldFrom, ui->OldTo, ui->SpecMov);
+        Moves [i][0] = ui->From;
+        Moves [i][1] = ui->To;
+      }
+    memcpy (Start, Board, sizeof (Board));
+    BoardInit ();
+    if (memcmp (Start, Board, sizeof (Board)) == 0 && ((MoveIDSave - UndoStackSize) & 1) == 0)   // The usual start
+      Res = DbAdd (NULL, false, UndoStackSize, Moves);
+    else
+      Res = DbAdd (Start, (MoveIDSave - UndoStackSize) & 1, UndoStackSize, Moves);
+    memcpy (Board, BoardSave, sizeof (Board));
+    MoveID = MoveIDSave;
+    return Res;
+  }
+
+// Import a saved game (.chess): replay its Log from BoardInit ()
+void DbImport (char *Name, void *Parameter)
+  {
     int f;   // file ID
-    char *Line, *l;
+    int Size, Plies, n;
+    char *Data, *dp;
+    _Coord Moves [SIZEARRAY (UndoStack)][2], c;
+    const char *Error;
     //
-    Line = (char *) malloc (250);
-    f = FileOpen_ (FileSettings, foWrite);
+    if (EngineBusy ())   // DbAdd () needs the Board
+      {
+        LogMessage ("*** NOT IMPORTED: THE ENGINE IS BUSY, TRY AGAIN WHEN IT HAS FINISHED ***");
+        return;
+      }
+    Error = "*** NOT IMPORTED: CAN'T READ THE FILE ***";
+    f = FileOpen (Name, foRead);
     if (f >= 0)
       {
-        l = Line;
-        StrCat (&l, "Depth\t");
-        IntToStr (&l, DepthPlay);
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        //
-        l = Line;
-        StrCat (&l, "Analysis\t");
-        IntToStr (&l, Analysis);
-        StrCat (&l, '\t');
-        IntToStr (&l, AnalysisScorePiece);
-        StrCat (&l, '\t');
-        IntToStr (&l, AnalysisScoreMove);
-        StrCat (&l, '\t');
-        IntToStr (&l, AnalysisScoreAttack);
-        StrCat (&l, '\t');
-        IntToStr (&l, AnalysisScoreAttackInd);
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        //
-        l = Line;
-        StrCat (&l, "Randomize\t");
-        IntToStr (&l, Randomize);
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        //
-        l = Line;
-        StrCat (&l, "Font\t");
-        StrCat (&l, FontPieces);
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        //
-        l = Line;
-        StrCat (&l, "FontMap\t");
-        IntToStr (&l, FontPiecesMap);
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        // Colours
-        l = Line;
-        StrCat (&l, "Colours\t");
-        NumToHex (&l, fMain->cBoard->Colours [0]); StrCat (&l, ',');
-        NumToHex (&l, fMain->cBoard->Colours [1]); StrCat (&l, ',');
-        NumToHex (&l, fMain->ColourBG [0]); StrCat (&l, ',');
-        NumToHex (&l, fMain->ColourBG [1]);
-        *l = 0;
-        FileWriteLine_ (f, Line);
-        // Done Close file & exit
+        Size = FileSize (f);
+        Data = (char *) malloc (Size + 1);
+        FileRead (f, (byte *) Data, Size);
+        Data [Size] = 0;
         FileClose (f);
+        Error = "*** NOT IMPORTED: NO LOG FROM THE START ***";
+        dp = strstr (Data, "Logs\t");
+        if (dp)
+          {
+            dp += 5;
+            while (*dp == '\a' && dp [1])   // Skip formats to the first move number
+              dp += 2;
+            if (dp [0] == '1' && dp [1] == '.')   // the Log starts at the start
+              {
+                Plies = 0;
+                n = 0;   // Squares found in this Log line
+                while (*dp && *dp != '\n' && *dp != '\r' && Plies < SIZEARRAY (Moves))
+                  {
+                    if (*dp == '\a' && dp [1])
+                      dp++;   // skip the format code
+                    else if (*dp == ',' || *dp == '\v')   // Next Log line: one move each
+                      n = 0;
+                    else if (*dp >= 'a' && *dp <= 'h' && dp [1] >= '1' && dp [1] <= '8' && n < 2)
+                      {
+                        c = {dp [0] - 'a', dp [1] - '1'};
+                        Moves [Plies][n++] = c;
+                        if (n == 2)
+                          Plies++;
+                        dp++;
+                      }
+                    dp++;
+                  }
+                if (Plies > 0)
+                  Error = DbAdd (NULL, false, Plies, Moves) ? NULL : "*** NOT IMPORTED: ILLEGAL MOVE, OR THE DATABASE CAN'T BE WRITTEN ***";
+              }
+          }
+        free (Data);
+      }
+    if (Error)
+      LogMessage (Error);
+    else
+      DatabaseShow = true;
+    Refresh = true;
+  }
+
+typedef struct
+  {
+    uint16_t Move;
+    int Games;
+    int Results [4];   // by _DbResult
+  } _DbMoveStats;
+
+// Count e in Stats, which has n moves so far. Returns the new n
+int DbStatsAdd (const _DbEntry *e, _DbMoveStats *Stats, int n, int StatsSize)
+  {
+    int j;
+    //
+    if (e->Move == DbMoveNone)
+      return n;
+    for (j = 0; j < n && Stats [j].Move != e->Move; j++)
+      ;
+    if (j == n)
+      {
+        if (n == StatsSize)
+          return n;
+        memset (&Stats [n], 0, sizeof (_DbMoveStats));
+        Stats [n++].Move = e->Move;
+      }
+    Stats [j].Games++;
+    Stats [j].Results [e->Result & 3]++;
+    return n;
+  }
+
+// First of the Count sorted entries in List with Key, or Count
+int DbFind (const _DbEntry *List, int Count, uint64_t Key)
+  {
+    int Lo, Hi, Mid;
+    //
+    Lo = 0;
+    Hi = Count;
+    while (Lo < Hi)
+      {
+        Mid = (Lo + Hi) / 2;
+        if (List [Mid].Key < Key)
+          Lo = Mid + 1;
+        else
+          Hi = Mid;
+      }
+    return Lo;
+  }
+
+// Games reaching the current Board & what was played from it, most played first. Returns how many moves
+int DbQuery (int *Games, _DbMoveStats *Stats, int StatsSize)
+  {
+    _DbMoveStats All [256];   // Every move played from here: more than any position has
+    uint64_t Key;
+    int i, j, n;
+    _DbMoveStats t;
+    //
+    DbLoad ();
+    Key = PositionKey ();
+    *Games = n = 0;
+    for (i = DbFind (DbMap, DbMapCount, Key); i < DbMapCount && DbMap [i].Key == Key; i++)
+      {
+        (*Games)++;
+        n = DbStatsAdd (&DbMap [i], All, n, SIZEARRAY (All));
       }
-    free (Line);
-    return f >= 0;
+    for (i = DbFind (DbIndex, DbIndexSorted, Key); i < DbIndexSorted && DbIndex [i].Key == Key; i++)
+      {
+        (*Games)++;
+        n = DbStatsAdd (&DbIndex [i], All, n, SIZEARRAY (All));
+      }
+    for (i = DbIndexSorted; i < DbIndexCount; i++)   // New games, not sorted yet
+      if (DbIndex [i].Key == Key)
+        {
+          (*Games)++;
+          n = DbStatsAdd (&DbIndex [i], All, n, SIZEARRAY (All));
+        }
+    for (i = 1; i < n; i++)   // Insertion sort, most played first
+      {
+        t = All [i];
+        for (j = i; j > 0 && All [j - 1].Games < t.Games; j--)
+          All [j] = All [j - 1];
+        All [j] = t;
+      }
+    n = Min (n, StatsSize);
+    memcpy (Stats, All, n * sizeof (_DbMoveStats));
+    return n;
   }
 
-int Colours [4];
+// Put Game in Games [n], latest (largest offset) first, keeping the GamesSize latest. Returns the new n
+int DbGamesAdd (uint32_t Game, uint32_t *Games, int n, int GamesSize)
+  {
+    int j;
+    //
+    for (j = 0; j < n && Games [j] > Game; j++)
+      ;
+    if (j == GamesSize || (j < n && Games [j] == Game))   // Older than all those kept, or there already (a repetition)
+      return n;
+    if (n < GamesSize)
+      n++;
+    memmove (&Games [j + 1], &Games [j], (n - 1 - j) * sizeof (uint32_t));
+    Games [j] = Game;
+    return n;
+  }
 
-bool SettingsLoad (void)
+// Offsets in FileGames of the games reaching the current Board, latest first, at most GamesSize. Returns how many
+int DbQueryGames (uint32_t *Games, int GamesSize)
   {
-    int f;   // file ID
-    int Size;
-    char *Data, *dp, *dp_;
-    _DirItem *d;
-    int i;
+    uint64_t Key;
+    int i, n;
     //
-    for (i = 0; i < SIZEARRAY (Colours); i++)
-      Colours [i] = -1;
-    f = FileOpen_ (FileSettings, foRead);
-    if (f >= 0)
+    DbLoad ();
+    Key = PositionKey ();
+    n = 0;
+    for (i = DbFind (DbMap, DbMapCount, Key); i < DbMapCount && DbMap [i].Key == Key; i++)
+      n = DbGamesAdd (DbMap [i].Game, Games, n, GamesSize);
+    for (i = DbFind (DbIndex, DbIndexSorted, Key); i < DbIndexSorted && DbIndex [i].Key == Key; i++)
+      n = DbGamesAdd (DbIndex [i].Game, Games, n, GamesSize);
+    for (i = DbIndexSorted; i < DbIndexCount; i++)   // New games, not sorted yet
+      if (DbIndex [i].Key == Key)
+        n = DbGamesAdd (DbIndex [i].Game, Games, n, GamesSize);
+    return n;
+  }
+
+typedef struct
+  {
+    int Plies;
+    _DbResult Result;
+    bool BlackFirst;
+    bool HasBoard;   // Start is the first position. Else it's BoardInit ()
+    _Piece Start [8][8];
+    uint16_t *Moves;   // [Plies], malloc'ed: free () it
+  } _DbGame;
+
+// Read the game at offset Game in FileGames. False if it can't be read: then there's nothing to free
+bool DbGameRead (uint32_t Game, _DbGame *g)
+  {
+    char Path [PathMax];
+    uint8_t Head [4], Packed [32];
+    FILE *f;
+    int x, y, n;
+    bool Res;
+    //
+    g->Moves = NULL;
+    HomePath (Path, FileGames);
+    f = fopen (Path, "rb");
+    if (f == NULL)
+      return false;
+    Res = Game >= sizeof (DbMagic) && fseek (f, Game, SEEK_SET) == 0 && fread (Head, 1, sizeof (Head), f) == sizeof (Head);
+    if (Res)
       {
-        Size = FileSize (f);
-        Data = (char *) malloc (Size + 1);
-        Data [Size] = 0;   // Terminate String
-        FileRead (f, (byte *) Data, Size);
-        dp = Data;
-        while (*dp)
+        g->Plies = Head [0] | Head [1] << 8;
+        g->Result = (_DbResult) (Head [2] & 3);
+        g->BlackFirst = Head [3] & dfBlack;
+        g->HasBoard = Head [3] & dfBoard;
+        if (g->HasBoard)
           {
-            // Break off a line
-            dp_ = StrPos (dp, '\n');
-            *dp_++ = 0;
-            // Look for a Data Name
-            if (StrMatch (&dp, "Depth\t"))
-              DepthPlay = StrGetNum (&dp);
-            else if (StrMatch (&dp, "Analysis\t"))
-              {
-                if (*dp)
-                  Analysis = (_Analysis) StrGetNum (&dp);
-                if (*dp)
-                  AnalysisScorePiece = StrGetNum (&dp);
-                if (*dp)
-                  AnalysisScoreMove = StrGetNum (&dp);
-                if (*dp)
-                  AnalysisScoreAttack = StrGetNum (&dp);
-                if (*dp)
-                  AnalysisScoreAttackInd = StrGetNum (&dp);
-              }
-            else if (StrMatch (&dp, "Randomize\t"))
-              Randomize = StrGetNum (&dp);
-            else if (StrMatch (&dp, "Font\t"))
-              {
-                // find font in Fonts
-                d = Fonts;
-                FontPiecesSelect = 0;
-                while (d)
-                  if (StrSame (d->Name, dp))   // Font found
-                    {
-                      FontPieces = d->Name;
-                      d = NULL;
-                    }
-                  else
-                    {
-                      d = d->Next;
-                      FontPiecesSelect++;
-                    }
-              }
-            else if (StrMatch (&dp, "FontMap\t"))
-              FontPiecesMap = StrGetNum (&dp);
-            else if (StrMatch (&dp, "Colours\t"))
-              {
-                for (i = 0; i < SIZEARRAY (Colours); i++)
-                  {
-                    Colours [i] = StrGetHex (&dp);
-                    if (dp)
-                      dp++;
-                  }
-              }
-            else
-              DebugAddS ("Properties File: Bad Item:", dp);
-            dp = dp_;
+            Res = fread (Packed, 1, sizeof (Packed), f) == sizeof (Packed);
+            for (y = 0; y < 8; y++)
+              for (x = 0; x < 8; x++)
+                {
+                  n = (Packed [(x + 8 * y) / 2] >> ((x & 1) * 4)) & 15;
+                  g->Start [x][y] = (n & 7) ? PieceFrom (n & 7, n & 8) : pEmpty;
+                }
           }
-        FileClose (f);
-        free (Data);
-        return true;
+        g->Moves = (uint16_t *) malloc ((g->Plies + 1) * sizeof (uint16_t));
+        Res = Res && (int) fread (g->Moves, sizeof (uint16_t), g->Plies, f) == g->Plies;   // Little-endian hosts, as written
       }
-    return false;
+    fclose (f);
+    if (!Res)
+      {
+        free (g->Moves);
+        g->Moves = NULL;
+      }
+    return Res;
   }
 
-void GraveyardUpdate (void)
+_Coord DbMoveFrom (uint16_t Move)
   {
-    int c;
-    _Piece *p;
-    char St [256], *s;
+    return {Move & 7, (Move >> 3) & 7};
+  }
+
+_Coord DbMoveTo (uint16_t Move)
+  {
+    return {(Move >> 6) & 7, (Move >> 9) & 7};
+  }
+
+
+const int DbShowGames = 4;   // Latest games reaching the Board shown by DbShow ()
+
+// Show the database moves from the current Board, with arrows for the most played, and the latest games
+void DbShow (void)
+  {
+    _DbMoveStats Stats [SIZEARRAY (fMain->cBoard->Hints)];
+    uint32_t Latest [DbShowGames];
+    const char *Results [4] = {"*", "1-0", "0-1", "1/2"};
+    char St [600], *s;
+    int Games, n, i, Found;
+    _DbGame g;
     //
+    n = DbQuery (&Games, Stats, SIZEARRAY (Stats));
     s = St;
-    for (c = 0; c <= 1; c++)   // Go through both "sides" of the Graveyard
+    StrCat (&s, "\a0Database: ");
+    IntToStr (&s, Games, DigitsCommas);
+    StrCat (&s, " games reach here, of ");
+    IntToStr (&s, DbGames, DigitsCommas);
+    StrCat (&s, '.');
+    for (i = 0; i < n; i++)
       {
-        p = fMain->Graveyard [c];
-        while (*p != pEmpty)
-          PieceToChar (&s, *p++);
-        if (!c)
-          StrCat (&s, '\n');
+        StrCat (&s, "   ");
+        CoordToStr (&s, DbMoveFrom (Stats [i].Move));
+        StrCat (&s, ' ');
+        CoordToStr (&s, DbMoveTo (Stats [i].Move));
+        StrCat (&s, ' ');
+        IntToStr (&s, Stats [i].Games, DigitsCommas);
+        StrCat (&s, " (\a7");
+        IntToStr (&s, Stats [i].Results [drWhite]);
+        StrCat (&s, "\a0 / ");
+        IntToStr (&s, Stats [i].Results [drDraw]);
+        StrCat (&s, " / ");
+        IntToStr (&s, Stats [i].Results [drBlack]);
+        StrCat (&s, ')');
+        fMain->cBoard->Hints [i][0] = DbMoveFrom (Stats [i].Move);
+        fMain->cBoard->Hints [i][1] = DbMoveTo (Stats [i].Move);
       }
+    Found = DbQueryGames (Latest, DbShowGames);
+    if (Found)
+      StrCat (&s, "\nLatest:");
+    for (i = 0; i < Found; i++)
+      if (DbGameRead (Latest [i], &g))
+        {
+          StrCat (&s, "   ");
+          StrCat (&s, Results [g.Result]);
+          StrCat (&s, " in ");
+          IntToStr (&s, (g.Plies + 1) / 2);
+          StrCat (&s, g.HasBoard ? " moves, set up" : " moves");
+          if (g.Plies)
+            {
+              StrCat (&s, ", opened ");
+              CoordToStr (&s, DbMoveFrom (g.Moves [0]));
+              CoordToStr (&s, DbMoveTo (g.Moves [0]));
+            }
+          free (g.Moves);
+        }
     *s = 0;
-    if (fMain->lGraveyard->Font)
-      fMain->lGraveyard->FontSet (FontPieces, fMain->lGraveyard->Font->Size);
-    fMain->lGraveyard->TextSet (St);
+    fMain->lPCStats->TextSet (St);
+    fMain->cBoard->HintsCount = n;
+    fMain->cBoard->Invalidate (true);
   }
 
-void GraveyardAddPiece (_Piece Piece)
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// PGN
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+const char *SanPieces = " KQRBN";   // Indexed by Piece (). Pawns have no letter
+
+// Add the SAN for From - To on Board [][] (before it's made), eg "Nbxd7+", "exd8=Q#", "O-O"
+void SanFromMove (char **s, _Coord From, _Coord To)
   {
-    _Piece *p;
+    _RootMove Legal [256];
+    _Piece p, OldFrom, OldTo;
+    _SpecialMove sm;
+    int n, i, t;
+    bool White, Capture, Other, SameFile, SameRank;
     //
-    p = fMain->Graveyard [PieceWhite (Piece)];   // Appropriate Graveyard "side"
-    while (*p != pEmpty)
-      p++;
-    *p++ = Piece;
-    *p = pEmpty;
-    Refresh = true;
+    p = Board [From.x][From.y];
+    t = Piece (p);
+    White = PieceWhite (p);
+    if (t == pKing && abs (To.x - From.x) == 2)   // Castle
+      StrCat (s, To.x > From.x ? "O-O" : "O-O-O");
+    else
+      {
+        Capture = Piece (Board [To.x][To.y]) != pEmpty || (t == pPawn && To.x != From.x);   // En-Passant too
+        if (t == pPawn)
+          {
+            if (Capture)
+              StrCat (s, (char) ('a' + From.x));
+          }
+        else
+          {
+            StrCat (s, SanPieces [t]);
+            n = RootMovesGet (White, Legal);   // Other pieces of this kind that could go there?
+            Other = SameFile = SameRank = false;
+            for (i = 0; i < n; i++)
+              if (Legal [i].To.x == To.x && Legal [i].To.y == To.y && Piece (Board [Legal [i].From.x][Legal [i].From.y]) == t &&
+                  (Legal [i].From.x != From.x || Legal [i].From.y != From.y))
+                {
+                  Other = true;
+                  SameFile |= Legal [i].From.x == From.x;
+                  SameRank |= Legal [i].From.y == From.y;
+                }
+            if (Other)
+              if (!SameFile)
+                StrCat (s, (char) ('a' + From.x));
+              else if (!SameRank)
+                StrCat (s, (char) ('1' + From.y));
+              else
+                CoordToStr (s, From);
+          }
+        if (Capture)
+          StrCat (s, 'x');
+        CoordToStr (s, To);
+        if (t == pPawn && (To.y == 0 || To.y == 7))
+          StrCat (s, "=Q");   // The engine always crowns a Queen
+      }
+    OldFrom = Board [From.x][From.y];
+    OldTo = Board [To.x][To.y];
+    sm = MovePiece (From, To);
+    if (InCheck (!White))
+      StrCat (s, RootMovesGet (!White, Legal) ? '+' : '#');
+    UnmovePiece (From, To, OldFrom, OldTo, sm);
+    InCheck (!White);   // Leave the King marks as they were
+    InCheck (White);
   }
 
-void GraveyardRemovePiece (_Piece Piece)
+// Find the legal move for San on Board [][]. False if there's none, it's ambiguous, or it crowns other than a Queen
+bool SanToMove (const char *San, bool White, _Coord *From, _Coord *To)
   {
-    _Piece *p, *q;
+    _RootMove Legal [256];
+    char St [16];
+    int n, i, l, t, FromX, FromY, Found;
+    const char *c;
     //
-    p = fMain->Graveyard [PieceWhite (Piece)];   // Select Grave "side"
-    q = NULL;
-    while (*p != pEmpty)   // Find end
+    l = 0;   // Copy the SAN characters, without check marks, annotations & crowning
+    for (c = San; *c && strchr ("KQRBNabcdefgh12345678xO0-=", *c) && l < (int) sizeof (St) - 1; c++)
+      St [l++] = *c;
+    St [l] = 0;
+    for (i = 0; i < l; i++)
+      if (St [i] == '=')
+        {
+          if (St [i + 1] && St [i + 1] != 'Q')   // The engine only crowns Queens: this game went elsewhere
+            return false;
+          St [l = i] = 0;
+        }
+    n = RootMovesGet (White, Legal);
+    if (St [0] == 'O' || St [0] == '0')   // Castle
       {
-        q = p;   // note last item (this will be deleted)
-        p++;
+        for (i = 0; i < n; i++)
+          if (Piece (Board [Legal [i].From.x][Legal [i].From.y]) == pKing && Legal [i].To.x - Legal [i].From.x == (l >= 5 ? -2 : 2))
+            {
+              *From = Legal [i].From;
+              *To = Legal [i].To;
+              return true;
+            }
+        return false;
       }
-    if (q)   // Is there an item here
-      *q = pEmpty;   // delete it
-    Refresh = true;
+    if (l > 2 && strchr ("QRBN", St [l - 1]) && St [l - 2] >= '1' && St [l - 2] <= '8')   // "e8Q"
+      {
+        if (St [l - 1] != 'Q')
+          return false;
+        St [--l] = 0;
+      }
+    if (l < 2 || St [l - 2] < 'a' || St [l - 2] > 'h' || St [l - 1] < '1' || St [l - 1] > '8')
+      return false;
+    To->x = St [l - 2] - 'a';
+    To->y = St [l - 1] - '1';
+    t = pPawn;
+    i = 0;
+    if (St [0] >= 'B' && St [0] <= 'R')
+      {
+        c = strchr (SanPieces + 1, St [0]);
+        if (c == NULL)
+          return false;
+        t = c - SanPieces;
+        i = 1;
+      }
+    FromX = FromY = -1;
+    for (; i < l - 2; i++)
+      if (St [i] >= 'a' && St [i] <= 'h')
+        FromX = St [i] - 'a';
+      else if (St [i] >= '1' && St [i] <= '8')
+        FromY = St [i] - '1';
+    Found = 0;
+    for (i = 0; i < n; i++)
+      if (Legal [i].To.x == To->x && Legal [i].To.y == To->y && Piece (Board [Legal [i].From.x][Legal [i].From.y]) == t &&
+          (FromX < 0 || Legal [i].From.x == FromX) && (FromY < 0 || Legal [i].From.y == FromY))
+        {
+          *From = Legal [i].From;
+          Found++;
+        }
+    return Found == 1;
   }
 
-void MovePiece_ (_Coord From, _Coord To)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// PGN import: read in blocks ending on a game boundary. Threads split each block into games & SAN tokens,
+// each in its own chunk of the block. Then the moves are found on the Board, in order, & added to the Database.
+// That's one more thread: finding a SAN move needs the engine's one Board, so it can't be shared out
+
+const int PgnBlockSize = 32 << 20;
+const int PgnThreadsMax = 16;
+
+typedef struct
   {
-    _UndoItem *ui;
+    int First, Plies;   // in _PgnChunk.Moves
+    _DbResult Result;
+    char *FEN;   // NULL for the usual start
+  } _PgnGame;
+
+typedef struct
+  {
+    char *Start, *End;
+    char **Moves;   // SAN, in the block, not terminated
+    int MovesCount, MovesSize;
+    _PgnGame *Games;
+    int GamesCount, GamesSize;
+    volatile bool Done;
+  } _PgnChunk;
+
+_PgnGame *PgnGameNew (_PgnChunk *c)
+  {
+    _PgnGame *g;
     //
-    ui = &UndoStack [UndoStackSize];
-    ui->From = From;
-    ui->To = To;
-    ui->OldFrom = Board [From.x][From.y];
-    ui->OldTo = Board [To.x][To.y];
-    ui->Log = fMain->sLogs;
+    if (c->GamesCount == c->GamesSize)
+      {
+        c->GamesSize = Max (c->GamesSize * 2, 256);
+        c->Games = (_PgnGame *) realloc (c->Games, c->GamesSize * sizeof (_PgnGame));
+      }
+    g = &c->Games [c->GamesCount++];
+    g->First = c->MovesCount;
+    g->Plies = 0;
+    g->Result = drUnknown;
+    g->FEN = NULL;
+    return g;
+  }
+
+_DbResult PgnResult (const char *s)
+  {
+    if (strncmp (s, "1-0", 3) == 0)
+      return drWhite;
+    if (strncmp (s, "0-1", 3) == 0)
+      return drBlack;
+    if (strncmp (s, "1/2-1/2", 7) == 0)
+      return drDraw;
+    return drUnknown;
+  }
+
+bool PgnSpace (char c)
+  {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+
+// Split a chunk into games. Only writes into its own chunk (FEN terminators)
+int PgnParseThread (void *Parameter)
+  {
+    _PgnChunk *c = (_PgnChunk *) Parameter;
+    _PgnGame *g;
+    char *p, *Tag, *Value;
+    int Depth;
+    bool InMoves;
+    //
+    g = NULL;
+    InMoves = false;
+    p = c->Start;
+    while (p < c->End)
+      if (PgnSpace (*p))
+        p++;
+      else if (*p == '[')   // [Tag "Value"]
+        {
+          if (g == NULL || InMoves)
+            {
+              g = PgnGameNew (c);
+              InMoves = false;
+            }
+          Tag = ++p;
+          while (p < c->End && *p != '"' && *p != ']' && *p != '\n')
+            p++;
+          Value = NULL;
+          if (p < c->End && *p == '"')
+            {
+              Value = ++p;
+              while (p < c->End && *p != '"' && *p != '\n')
+                p++;
+            }
+          if (Value && p < c->End && *p == '"')
+            {
+              if (strncmp (Tag, "FEN ", 4) == 0)
+                {
+                  *p = 0;
+                  g->FEN = Value;
+                }
+              else if (strncmp (Tag, "Result ", 7) == 0)
+                g->Result = PgnResult (Value);
+              p++;
+            }
+          while (p < c->End && *p != ']' && *p != '\n')
+            p++;
+          p++;
+        }
+      else if (*p == '{')   // Comment
+        {
+          while (p < c->End && *p != '}')
+            p++;
+          p++;
+        }
+      else if (*p == ';' || *p == '%')   // Comment to the end of the line
+        while (p < c->End && *p != '\n')
+          p++;
+      else if (*p == '(')   // Variation
+        {
+          Depth = 0;
+          do
+            {
+              if (*p == '(')
+                Depth++;
+              else if (*p == ')')
+                Depth--;
+              else if (*p == '{')
+                while (p + 1 < c->End && p [1] != '}')
+                  p++;
+              p++;
+            }
+          while (p < c->End && Depth);
+        }
+      else if (*p == '*' || PgnResult (p) != drUnknown)   // End of the game
+        {
+          if (g && g->Result == drUnknown)
+            g->Result = PgnResult (p);
+          g = NULL;
+          InMoves = false;
+          while (p < c->End && !PgnSpace (*p))
+            p++;
+        }
+      else if (((*p >= '0' && *p <= '9') || *p == '.' || *p == '$') && strncmp (p, "0-0", 3) != 0)   // Move number or NAG
+        while (p < c->End && !PgnSpace (*p) && (*p == '.' || *p == '$' || (*p >= '0' && *p <= '9')))
+          p++;
+      else   // A move
+        {
+          if (g == NULL)
+            g = PgnGameNew (c);
+          InMoves = true;
+          if (c->MovesCount == c->MovesSize)
+            {
+              c->MovesSize = Max (c->MovesSize * 2, 4096);
+              c->Moves = (char **) realloc (c->Moves, c->MovesSize * sizeof (char *));
+            }
+          c->Moves [c->MovesCount++] = p;
+          g->Plies++;
+          while (p < c->End && !PgnSpace (*p) && !strchr ("{}()[];", *p))
+            p++;
+        }
+    c->Done = true;
+    return 0;
+  }
+
+// Find each game's moves on the Board & add it to the open Database files. Counts games Added & Skipped
+void PgnChunkAdd (_PgnChunk *c, FILE *fg, FILE *fi, int *Added, int *Skipped)
+  {
+    _DbEntry Entries [SIZEARRAY (UndoStack) + 1];
+    _Coord From, To;
+    _Piece Start [8][8];
+    _PgnGame *g;
+    int i, j;
+    bool Ok, Black;
+    //
+    for (i = 0; i < c->GamesCount && !PgnAbort; i++)
+      {
+        g = &c->Games [i];
+        Ok = g->Plies > 0 && g->Plies <= SIZEARRAY (UndoStack);
+        if (Ok)
+          if (g->FEN)
+            {
+              Ok = BoardFromFEN (g->FEN);
+              memcpy (Start, Board, sizeof (Board));
+              Black = MoveID & 1;
+            }
+          else
+            BoardInit ();
+        for (j = 0; Ok && j < g->Plies; j++)   // SanToMove () only finds legal moves: nothing to check again
+          {
+            Entries [j].Key = PositionKey ();
+            Ok = SanToMove (c->Moves [g->First + j], (MoveID & 1) ^ 1, &From, &To);
+            if (Ok)
+              {
+                Entries [j].Move = From.x + 8 * From.y + 64 * (To.x + 8 * To.y);
+                MovePiece (From, To);
+              }
+          }
+        if (Ok)
+          {
+            Entries [j].Key = PositionKey ();
+            Entries [j].Move = DbMoveNone;
+            DbWrite (fg, fi, g->FEN ? Start : NULL, g->FEN && Black, g->Plies, Entries, g->Result != drUnknown ? g->Result : DbResult ((MoveID & 1) ^ 1));
+            (*Added)++;
+          }
+        else
+          (*Skipped)++;
+      }
+  }
+
+int PgnFile;   // file ID, open while PgnThread runs
+volatile int PgnAdded, PgnSkipped;   // so far, for progress
+char PgnStats [200];   // Shown when it's Finished
+
+// Add every game in PgnFile to the Database, keeping the Database files open throughout
+int PgnThread (void *Parameter)
+  {
+    _PgnChunk Chunks [PgnThreadsMax];
+    _Piece BoardSave [8][8];
+    char *Data, *Cut, *p, *s;
+    int Size, Used, Carry, Threads, i, Added, Skipped, Time, MoveIDSave;
+    bool Eof, Ok;
+    FILE *fg, *fi;
     //
-    if ((MoveID & 1) == 0)   // new White move
+    TraceThread = ttImport;
+    _TraceSpan Span ("PGN Import");
+    Time = ClockMS ();
+    DbLoad ();
+    memcpy (BoardSave, Board, sizeof (Board));
+    MoveIDSave = MoveID;
+    Threads = 4;
+#ifdef __linux__
+    Threads = Min (Max ((int) sysconf (_SC_NPROCESSORS_ONLN), 1), PgnThreadsMax);
+#endif
+    Size = PgnBlockSize;
+    Data = (char *) malloc (Size + 1);
+    Used = 0;
+    Added = Skipped = 0;
+    Eof = false;
+    Ok = DbFilesOpen (&fg, &fi);
+    while (Ok && (!Eof || Used) && !PgnAbort)
       {
-        //StrCat (&fMain->sLogs, "\a00\a11\a22\a33\a44\a55\a66\a77\a88\a99 ");
-        StrCat (&fMain->sLogs, "\a8");
-        NumToStr (&fMain->sLogs, (MoveID >> 1) + 1);
-        StrCat (&fMain->sLogs, ".  \a7");
+        if (!Eof)   // Fill the block
+          {
+            i = FileRead (PgnFile, (byte *) Data + Used, Size - Used);
+            Eof = i <= 0;
+            Used += Max (i, 0);
+          }
+        Data [Used] = 0;
+        Cut = Data + Used;   // End the block after the last whole game
+        if (!Eof)
+          {
+            for (p = Data + Used - 1; p > Data && !(p [0] == '[' && p [-1] == '\n' && strncmp (p, "[Event ", 7) == 0); p--)
+              ;
+            if (p > Data)
+              Cut = p;
+            else if (Used == Size)   // One huge game: make room
+              {
+                Size *= 2;
+                Data = (char *) realloc (Data, Size + 1);
+                continue;
+              }
+            else
+              continue;
+          }
+        for (i = 0; i < Threads; i++)   // Split at games too
+          {
+            memset (&Chunks [i], 0, sizeof (_PgnChunk));
+            Chunks [i].Start = i ? Chunks [i - 1].End : Data;
+            Chunks [i].End = Cut;
+            if (i < Threads - 1)
+              {
+                p = Data + (Cut - Data) * (i + 1) / Threads;
+                if (p < Chunks [i].Start)
+                  p = Chunks [i].Start;
+                p = strstr (p, "\n[Event ");
+                if (p && p < Cut)
+                  Chunks [i].End = p + 1;
+              }
+          }
+        for (i = 1; i < Threads; i++)
+          StartThread (PgnParseThread, &Chunks [i]);
+        PgnParseThread (&Chunks [0]);
+        for (i = 0; i < Threads; i++)
+          {
+            while (!Chunks [i].Done)
+              usleep (100);
+            PgnChunkAdd (&Chunks [i], fg, fi, &Added, &Skipped);   // In order, on this thread
+            PgnAdded = Added;
+            PgnSkipped = Skipped;
+            free (Chunks [i].Moves);
+            free (Chunks [i].Games);
+          }
+        Carry = Data + Used - Cut;   // The start of the next game
+        memmove (Data, Cut, Carry);
+        Used = Carry;
+        if (Eof)
+          break;
       }
-    else   // new black move
-      StrCat (&fMain->sLogs, "\a0");
-    /*// Set colour
-    if (PieceWhite (ui->OldFrom) == PlayerWhite)   // Player's move
-      StrCat (&fMain->sLogs, "\a7");   // white
-    else
-      StrCat (&fMain->sLogs, "\a0");   // black*/
-    // Log move and update Graveyard
-    CoordToStr (&fMain->sLogs, From);
-    if (Piece (ui->OldTo) != pEmpty)   // taking piece
+    if (Ok)
+      DbFilesClose (fg, fi);
+    FileClose (PgnFile);
+    free (Data);
+    memcpy (Board, BoardSave, sizeof (Board));
+    MoveID = MoveIDSave;
+    DbSort ();
+    Time = ClockMS () - Time;
+    s = PgnStats;
+    if (Ok)
       {
-        StrCat (&fMain->sLogs, "\abx\ab");   // show an x
-        GraveyardAddPiece (ui->OldTo);   // Add to Graveyard
+        StrCat (&s, "PGN: ");
+        IntToStr (&s, Added, DigitsCommas);
+        StrCat (&s, " games added, ");
+        IntToStr (&s, Skipped, DigitsCommas);
+        StrCat (&s, " skipped in ");
+        IntToStrDecimals (&s, Time, 3);
+        StrCat (&s, " sec. Database: ");
+        IntToStr (&s, DbGames, DigitsCommas);
+        StrCat (&s, " games");
       }
     else
-      StrCat (&fMain->sLogs, ' ');
-    CoordToStr (&fMain->sLogs, To);
-    ui->SpecMov = MovePiece (From, To);
-    if (ui->SpecMov != smNone)
-      StrCat (&fMain->sLogs, '*');
-    //else
-    //  StrCat (&fMain->sLogs, ' ');
-    if (ui->SpecMov == smEnPassant)
-      GraveyardAddPiece (PieceFrom (pPawn, !PieceWhite (ui->OldFrom)));
-    if (MoveID & 1)   // make ready for a Black Move
-      StrCat (&fMain->sLogs, '\v');
-    else
-      StrCat (&fMain->sLogs, '\n');
-    //
-    if (UndoStackSize  + 1 < SIZEARRAY (UndoStack))   // just in case
-      UndoStackSize++;
+      StrCat (&s, "\ab\a1Couldn't open the Database files\ab");
+    *s = 0;
+    PgnThreadStarted = false;   // before Finished, as the engine threads do
+    __sync_synchronize ();
+    PgnThreadFinished = true;
+    return 0;
   }
 
-bool UnmovePiece_ (void)
+// FileSelect () call back: import a PGN file to the Database on PgnThread
+void PgnImport (char *Name, void *Parameter)
   {
-    _UndoItem *ui;
-    //
-    if (UndoStackSize == 0)
-      return false;
-    UndoStackSize--;
-    ui = &UndoStack [UndoStackSize];
-    UnmovePiece (ui->From, ui->To, ui->OldFrom, ui->OldTo, ui->SpecMov);
-    if (Piece (ui->OldTo) != pEmpty)   // replacing taken piece
-      GraveyardRemovePiece (ui->OldTo);
-    if (ui->SpecMov == smEnPassant)
-      GraveyardRemovePiece (PieceFrom (pPawn, !PieceWhite (ui->OldFrom)));
-    fMain->sLogs = ui->Log;
-    return true;
+    if (EngineBusy ())   // The Board's needed
+      {
+        LogMessage ("*** NOT IMPORTED: THE ENGINE IS BUSY, TRY AGAIN WHEN IT HAS FINISHED ***");
+        return;
+      }
+    PgnFile = FileOpen (Name, foRead);
+    if (PgnFile < 0)
+      return;
+    PgnAbort = false;
+    PgnAdded = PgnSkipped = 0;
+    memcpy (BoardView, Board, sizeof (BoardView));
+    fMain->Toolbar->EnabledSet (false);
+    PgnThreadStarted = true;
+    StartThread (PgnThread, NULL);
   }
 
-bool PrevPlayer (void)
+// eg "PGN: 12,345 games added, 6 skipped so far"
+void PgnProgressShow (void)
   {
-    _UndoItem *ui;
+    char St [100], *s;
     //
-    ui = &UndoStack [UndoStackSize];
-    return PieceWhite (ui->OldFrom);
-  }
-
-bool MoveOposite (_UndoItem *m1, _UndoItem *m2)
-  {
-    if (m1->From.x == m2->To.x && m1->From.y == m2->To.y)
-      if (m1->To.x == m2->From.x && m1->To.y == m2->From.y)
-        return true;
-    return false;
+    s = St;
+    StrCat (&s, "PGN: ");
+    IntToStr (&s, PgnAdded, DigitsCommas);
+    StrCat (&s, " games added, ");
+    IntToStr (&s, PgnSkipped, DigitsCommas);
+    StrCat (&s, " skipped so far");
+    *s = 0;
+    fMain->lPCStats->TextSet (St);
   }
 
-bool NoDraws = true;
-
-bool CheckRepeat (void)
+// FileSelect () call back: write the game so far, from UndoStack
+void PgnSave (char *Name, void *Parameter)
   {
-    if (NoDraws)
-      if (UndoStackSize >= 4)
-        if (MoveOposite (&UndoStack [UndoStackSize-1], &UndoStack [UndoStackSize-3]))
-          if (MoveOposite (&UndoStack [UndoStackSize-2], &UndoStack [UndoStackSize-4]))
-            {
-              MoveForbidenFrom = UndoStack [UndoStackSize-4].From;
-              MoveForbidenTo = UndoStack [UndoStackSize-4].To;
-              return true;
-            }
-    MoveForbidenFrom = {-1, -1};
-    MoveForbidenTo = {-1, -1};
-    return false;
+    _Piece BoardSave [8][8], Start [8][8];
+    int MoveIDSave, i, x, y, Empty;
+    char Line [200], *l, Move [24], *m;
+    _UndoItem *ui;
+    _DbResult Result;
+    const char *Results [4] = {"*", "1-0", "0-1", "1/2-1/2"};
+    time_t Now;
+    bool Usual;
+    int f;   // file ID
+    //
+    if (EngineBusy ())
+      return;
+    f = FileOpen (Name, foWrite);
+    if (f < 0)
+      {
+        LogMessage ("*** ERROR SAVING FILE ***");
+        return;
+      }
+    Result = DbResult ((MoveID & 1) ^ 1);
+    memcpy (BoardSave, Board, sizeof (Board));
+    MoveIDSave = MoveID;
+    for (i = UndoStackSize - 1; i >= 0; i--)   // Back to the start
+      {
+        ui = &UndoStack [i];
+        UnmovePiece (ui->From, ui->To, ui->OldFrom, ui->OldTo, ui->SpecMov);
+      }
+    MoveID = MoveIDSave - UndoStackSize;
+    // Tags
+    Now = time (NULL);
+    FileWriteLine (f, (char *) "[Event \"Stewy's Chess\"]");
+    FileWriteLine (f, (char *) "[Site \"?\"]");
+    strftime (Line, sizeof (Line), "[Date \"%Y.%m.%d\"]", localtime (&Now));
+    FileWriteLine (f, Line);
+    FileWriteLine (f, (char *) "[Round \"-\"]");
+    FileWriteLine (f, (char *) (PlayerWhite ? "[White \"Player\"]" : "[White \"PC\"]"));
+    FileWriteLine (f, (char *) (PlayerWhite ? "[Black \"PC\"]" : "[Black \"Player\"]"));
+    l = Line;
+    StrCat (&l, "[Result \"");
+    StrCat (&l, Results [Result]);
+    StrCat (&l, "\"]");
+    *l = 0;
+    FileWriteLine (f, Line);
+    memcpy (Start, Board, sizeof (Board));   // Is this the usual start?
+    BoardInit ();
+    Usual = true;
+    for (y = 0; y < 8; y++)
+      for (x = 0; x < 8; x++)
+        Usual &= Piece (Board [x][y]) == Piece (Start [x][y]) && (Piece (Board [x][y]) == pEmpty || PieceWhite (Board [x][y]) == PieceWhite (Start [x][y]));
+    memcpy (Board, Start, sizeof (Board));
+    MoveID = MoveIDSave - UndoStackSize;
+    if (!Usual || MoveID)   // Not from move 1, or the numbers wouldn't match
+      {
+        l = Line;
+        StrCat (&l, "[SetUp \"1\"]");
+        *l = 0;
+        FileWriteLine (f, Line);
+        l = Line;
+        StrCat (&l, "[FEN \"");
+        for (y = 7; y >= 0; y--)
+          {
+            Empty = 0;
+            for (x = 0; x < 8; x++)
+              if (Piece (Board [x][y]) == pEmpty)
+                Empty++;
+              else
+                {
+                  if (Empty)
+                    StrCat (&l, (char) ('0' + Empty));
+                  Empty = 0;
+                  StrCat (&l, (char) (" kqrbnp" [Piece (Board [x][y])] - (PieceWhite (Board [x][y]) ? 'a' - 'A' : 0)));
+                }
+            if (Empty)
+              StrCat (&l, (char) ('0' + Empty));
+            if (y)
+              StrCat (&l, '/');
+          }
+        StrCat (&l, (MoveID & 1) ? " b " : " w ");
+        m = l;
+        for (i = 0; i < 4; i++)   // KQkq
+          if (CastleRight (i < 2, (i & 1) ^ 1))
+            StrCat (&l, "KQkq" [i]);
+        if (l == m)
+          StrCat (&l, '-');
+        StrCat (&l, " - 0 ");
+        IntToStr (&l, (MoveID >> 1) + 1);
+        StrCat (&l, "\"]");
+        *l = 0;
+        FileWriteLine (f, Line);
+      }
+    FileWriteLine (f, (char *) "");
+    // Moves, in lines of up to 80
+    l = Line;
+    for (i = 0; i < UndoStackSize; i++)
+      {
+        ui = &UndoStack [i];
+        m = Move;
+        if ((MoveID & 1) == 0 || i == 0)
+          {
+            IntToStr (&m, (MoveID >> 1) + 1);
+            StrCat (&m, (MoveID & 1) ? "... " : ". ");
+          }
+        SanFromMove (&m, ui->From, ui->To);
+        *m = 0;
+        if (l - Line + (m - Move) >= 80)
+          {
+            *--l = 0;   // drop the trailing space
+            FileWriteLine (f, Line);
+            l = Line;
+          }
+        StrCat (&l, Move);
+        StrCat (&l, ' ');
+        MovePiece (ui->From, ui->To);
+      }
+    StrCat (&l, Results [Result]);
+    *l = 0;
+    FileWriteLine (f, Line);
+    FileWriteLine (f, (char *) "");
+    FileClose (f);
+    memcpy (Board, BoardSave, sizeof (Board));
+    MoveID = MoveIDSave;
   }
 
 
@@ -964,9 +5279,10 @@ class _FormProperties: public _Form
   {
     public:
       _Tabs *tPage;
-      _Container *cPageAppearence, *cPageChessEngine;
+      _Container *cPageAppearence, *cPageChessEngine, *cPageAnalysis;
       // PageAppearence
       _CheckBox *cbRotate;
+      _CheckBox *cbControl;
       _Label *lColour;
       _DropList *dlColour;
       _Button *bColourB0, *bColourB1;
@@ -985,6 +5301,15 @@ class _FormProperties: public _Form
       _EditNumber *eScorePiece, *eScoreMove, *eScoreAttack, *eScoreAttackInd;
       _Label *lRandomize;
       _Slider *sRandomize;
+      _CheckBox *cbCache;
+      _Label *lMate;
+      _EditNumber *eMate;
+      _Label *lPin;
+      _EditNumber *ePin;
+      // PageAnalysis
+      _Label *lLines;
+      _EditNumber *eLines;
+      _CheckBox *cbPerf;
       _FormProperties (char *Title, _Point Position);
      ~_FormProperties (void);
   };
@@ -999,7 +5324,7 @@ _FormProperties::~_FormProperties (void)
 void StrDepth (char *St)
   {
     StrCat (&St, "Depth ");
-    IntToStr (&St, DepthPlay);
+    IntToStr (&St, AnalyseThreadStarted ? DepthUser : DepthPlay);
     *St = 0;
   }
 
@@ -1007,6 +5332,7 @@ void ActionPropertiesTab (_Tabs *Tabs)
   {
     fProperties->cPageAppearence->VisibleSet (Tabs->Selected == 0);
     fProperties->cPageChessEngine->VisibleSet (Tabs->Selected == 1);
+    fProperties->cPageAnalysis->VisibleSet (Tabs->Selected == 2);
   }
 
 void ActionDepth (_Container *Container)
@@ -1016,11 +5342,24 @@ void ActionDepth (_Container *Container)
     //
     b = (_ButtonArrow *) Container;
     // Adjust Depth
-    if (!b->Down && !PlayThreadStarted)
-      if (b->Direction == dUp)
-        DepthPlay = Min (DepthPlay + 1, 9);
-      else if (b->Direction == dDown)
-        DepthPlay = Max (DepthPlay - 1, 0);
+    if (!b->Down)
+      if (!EngineBusy ())
+        {
+          if (b->Direction == dUp)
+            DepthPlay = Min (DepthPlay + 1, DepthMax);
+          else if (b->Direction == dDown)
+            DepthPlay = Max (DepthPlay - 1, 0);
+        }
+      else if (AnalyseThreadStarted && AnalyseContinuous)   // It goes on to DepthMax anyway: just change the setting it puts back
+        {
+          if (b->Direction == dUp)
+            DepthUser = Min (DepthUser + 1, DepthMax);
+          else if (b->Direction == dDown)
+            DepthUser = Max (DepthUser - 1, 0);
+          __sync_synchronize ();
+          if (!AnalyseThreadStarted)   // It put the old one back meanwhile
+            DepthPlay = DepthUser;
+        }
     // update label
     StrDepth (St);
     fProperties->lDepth->TextSet (St);
@@ -1030,6 +5369,23 @@ void ActionAnalysis (_Container *Container)
   {
     Analysis = (_Analysis) fProperties->dlAnalysis->Selected;
     NoDraws = fProperties->cbNoDraws->Down;
+    CacheEnabled = fProperties->cbCache->Down;
+  }
+
+void ActionMate (_Container *Container)
+  {
+    MateMoves = fProperties->eMate->Value;
+  }
+
+void ActionPin (_Container *Container)
+  {
+    PinCPU = fProperties->ePin->Value;
+  }
+
+void ActionLines (_Container *Container)
+  {
+    AnalyseLines = fProperties->eLines->Value;
+    PerfEnabled = fProperties->cbPerf->Down;
   }
 
 void ActionAnalysisScore (_Container *Container)
@@ -1053,7 +5409,7 @@ void ActionRandomize (_Slider *Slider)
     NumToStr (&s, Randomize);
     *s = 0;
     ((_FormProperties *) (Slider->Form))->lRandomize->TextSet (St);
-    DebugAddInt ("Randomize =", Randomize);
+    TraceMark ("Randomize", Randomize);
   }
 
 void ActionRotate (_CheckBox *CheckBox)
@@ -1062,6 +5418,12 @@ void ActionRotate (_CheckBox *CheckBox)
     fMain->cBoard->Invalidate (true);
   }
 
+void ActionControl (_CheckBox *CheckBox)
+  {
+    fMain->cBoard->ControlShow = CheckBox->Down;
+    fMain->cBoard->Invalidate (true);
+  }
+
 void ActionColour (_Container *Container)
   {
     _DropList *dl;
@@ -1143,7 +5505,7 @@ void ActionFontMap (_DropList *dl)
       }
   }
 
-_FormProperties::_FormProperties (char *Title, _Point Position): _Form (Title, {Position.x, Position.y, 240, 240}, waAlwaysOnTop)
+_FormProperties::_FormProperties (char *Title, _Point Position): _Form (Title, {Position.x, Position.y, 240, 332}, waAlwaysOnTop)
   {
     const int Th = 24;
     const int Bdr = 4;
@@ -1156,13 +5518,16 @@ _FormProperties::_FormProperties (char *Title, _Point Position): _Form (Title, {
     //
     St = (char *) malloc (MaxPath);
     Container->FontSet (NULL, 12);
-    tPage = new _Tabs (Container, {0, 0, 0, Th}, "Appearence\t\a2Chess Engine\a2", (_Action) ActionPropertiesTab);
+    tPage = new _Tabs (Container, {0, 0, 0, Th}, "Appearence\t\a2Chess Engine\a2\tAnalysis", (_Action) ActionPropertiesTab);
     // Page Appearence
     cPageAppearence = new _Container (Container, {0, Th, 0, 0});
     x = y = Bdr;
     cbRotate = new _CheckBox (cPageAppearence, {x, y, -Bdr, Ht},"Rotate Board if playing Black", (_Action) ActionRotate);
     cbRotate->Down = fMain->cBoard->RotateAllowed;
     y += Ht + Bdr;
+    cbControl = new _CheckBox (cPageAppearence, {x, y, -Bdr, Ht},"Show squares controlled", (_Action) ActionControl);
+    cbControl->Down = fMain->cBoard->ControlShow;
+    y += Ht + Bdr;
     lColour = new _Label (cPageAppearence, {x, y, 64, Ht},"Colours");
     x += 64;
     bColourB0 = new _Button (cPageAppearence, {x, y, Ht, Ht}, NULL, (_Action) ActionColourBG);
@@ -1252,6 +5617,30 @@ _FormProperties::_FormProperties (char *Title, _Point Position): _Form (Title, {
       v++;
     sRandomize->ValueSet (v);
     ActionRandomize (sRandomize);
+    x = Bdr;
+    y += Ht + Bdr;
+    cbCache = new _CheckBox (cPageChessEngine, {x, y, -Bdr, Ht}, "Remember PC moves (Position Cache)", ActionAnalysis);
+    cbCache->Down = CacheEnabled;
+    y += Ht + Bdr;
+    lMate = new _Label (cPageChessEngine, {x, y, 0, Ht}, "Mate in"); x += 80;
+    eMate = new _EditNumber (cPageChessEngine, {x, y, 64, Ht}, NULL, 1, SIZEARRAY (MateLine) / 2, ActionMate);
+    eMate->Value = MateMoves;
+    x = Bdr;
+    y += Ht;
+    lPin = new _Label (cPageChessEngine, {x, y, 0, Ht}, "Search CPU"); x += 80;
+    ePin = new _EditNumber (cPageChessEngine, {x, y, 64, Ht}, NULL, -1, 255, ActionPin);
+    ePin->Value = PinCPU;
+    // Page Analysis
+    cPageAnalysis = new _Container (Container, {0, Th, 0, 0});
+    cPageAnalysis->VisibleSet (false);
+    x = y = Bdr;
+    lLines = new _Label (cPageAnalysis, {x, y, 0, Ht}, "Best Moves"); x += 80;
+    eLines = new _EditNumber (cPageAnalysis, {x, y, 64, Ht}, NULL, 0, SIZEARRAY (fMain->cBoard->Hints), ActionLines);
+    eLines->Value = AnalyseLines;
+    x = Bdr;
+    y += Ht + Bdr;
+    cbPerf = new _CheckBox (cPageAnalysis, {x, y, -Bdr, Ht}, "CPU counters in Stats (Linux)", ActionLines);
+    cbPerf->Down = PerfEnabled;
     free (St);
   }
 
@@ -1271,6 +5660,8 @@ void ActionProperties (_Container *Container)
 char *Help = "\ab\a1Stewy's Chess\ab\a0\e5\n"
              "\nDrag a piece to move.\n"
              "Castling, Crowning & En-Passant allowed.\n"
+             "Red crosses mark captures that lose material.\n"
+             "Drag the move list up & down to see earlier moves.\n"
              "PC plays to win and avoid a Draw.\n"
              "\n"
              "\auSetup\au:\n"
@@ -1284,18 +5675,37 @@ char *Help = "\ab\a1Stewy's Chess\ab\a0\e5\n"
              "    \aiScore / Attack\ai: the value of each piece you can attack (\").\n"
              "    \aiScore / Attack'\ai: the value of each piece you guard (\").\n"
              "    \aiRandomize\ai adds a random element.\n"
+             "    \aiPosition Cache\ai: reuse PC moves found before, even in earlier sessions.\n"
+             "    \aiSearch CPU\ai: keep searches on one CPU (Linux), -1 lets the system choose.\n"
              "\n"
-             "\auUndo\au: Take back moves.\n"
+             "\auUndo\au: Take back moves. \auRedo\au (right-click) plays them again.\n"
+             "  Click a move in the list to go straight to it.\n"
              "\n"
              "\auPlay\au: The PC will decide the next move.\n"
              "\n"
              "\auRestart\au: Start again and choose your colour OR play a friend.\n"
+             "  The game is kept as you play, so it's still there after closing or a crash.\n"
              "\n"
              "\auEdit\au: Move any pieces anywhere.\n"
              "  right-click for a new piece.\n"
+             "  The best moves are shown, searching deeper until the Board changes.\n"
              "\n"
              "\auStats\au: PC moves considered, time taken & Projected Board Score, in \aiPawns\ai.\n"
              "\n"
+             "\auAnalyse\au (right-click): the best moves for whoever is to play, with their scores\n"
+             "  & best replies. Set how many on the \aiAnalysis\ai page of Setup.\n"
+             "  \aiCPU counters\ai there adds cycles, cache misses etc to the Stats.\n"
+             "\auReview Game\au (right-click): replay the game, marking each move that throws away\n"
+             "  score: ?! inaccuracy, ? mistake, ?? blunder, with the better move & what it lost.\n"
+             "\auSolve Mate\au (right-click): look for a forced mate for whoever is to play, in up to\n"
+             "  the \aiMate in\ai moves set on the \aiChess Engine\ai page.\n"
+             "\auAdd to Database\au (right-click): keep this game. \auImport to Database\au adds a saved game.\n"
+             "\auDatabase Moves\au (right-click): moves played from here in Database games, with\n"
+             "  how they ended: \a7White wins\a0 / draws / Black wins.\n"
+             "\auSave PGN\au (right-click): the game for other chess programmes. \auImport PGN\au adds\n"
+             "  every game in a PGN file to the Database.\n"
+             "\auSave Trace\au (right-click): timings of recent drawing & searches, for chrome://tracing.\n"
+             "\n"
              "Right click anywhere for game save etc.\n"
              "\n"
              "\au\a4github.com/StewartTunbridge\n"
@@ -1322,6 +5732,7 @@ void ActionPlayColour (int Result, void *Parameter)//(_Container *Container, int
         else if (Result == 2)   // Human verses Human
           PCPlays = false;
         Restart = true;
+        AnalyseAbort = true;   // Edit's background Analysis has the Board: Restart waits for it to go
       }
   }
 
@@ -1335,7 +5746,8 @@ void ActionEdit (_Button *Button)
     fMain->mPieces->EnabledSet (Button->Down);
     fMain->bUndo->EnabledSet (!Button->Down);
     fMain->bPlay->EnabledSet (!Button->Down);
-    UndoStackSize = 0;
+    UndoClear ();
+    AnalyseAbort = true;   // Any background Analysis is for the other mode
     Analyse = true;
   }
 
@@ -1359,13 +5771,40 @@ void ActionMenu (_Container *Container)
     _Menu *Menu;
     //
     Menu = (_Menu *) Container;
-    if (!PlayThreadStarted)
-      if (Menu->Selected == 0)   // Reload
-        Load = true;
-      else if (Menu->Selected == 1)   // Save
-        Save = true;
-      else if (Menu->Selected == 2)   // Save Log
-        SaveLog = true;
+    if (EngineBusy ())
+      if (AnalyseThreadStarted && AnalyseContinuous)   // Edit's background Analysis: stop it, do this, then carry on
+        {
+          AnalyseAbort = true;
+          AnalyseResume = true;
+        }
+      else
+        return;
+    if (Menu->Selected == 0)   // Reload
+      Load = true;
+    else if (Menu->Selected == 1)   // Save
+      Save = true;
+    else if (Menu->Selected == 2)   // Save Log
+      SaveLog = true;
+    else if (Menu->Selected == 3)   // Analyse
+      Analyse = true;
+    else if (Menu->Selected == 4)   // Review Game
+      Review = true;
+    else if (Menu->Selected == 5)   // Solve Mate
+      Mate = true;
+    else if (Menu->Selected == 6)   // Save Trace
+      SaveTrace = true;
+    else if (Menu->Selected == 7)   // Add to Database
+      DatabaseAdd = true;
+    else if (Menu->Selected == 8)   // Import to Database
+      DatabaseImport = true;
+    else if (Menu->Selected == 9)   // Database Moves
+      DatabaseShow = true;
+    else if (Menu->Selected == 10)   // Save PGN
+      SavePGN = true;
+    else if (Menu->Selected == 11)   // Import PGN
+      ImportPGN = true;
+    else if (Menu->Selected == 12)   // Redo
+      Redo = true;
   }
 
 void ActionPieces (_MenuPopup *mp)
@@ -1374,7 +5813,7 @@ void ActionPieces (_MenuPopup *mp)
     int dx, dy;
     _Coord Sel;
     //
-    if (mp->Selected >= 0)
+    if (mp->Selected >= 0 && BoardInputAllowed ())
       {
         cb = (_ChessBoard *) mp->Parent;
         dx = cb->Rect.Width / 8;
@@ -1382,12 +5821,15 @@ void ActionPieces (_MenuPopup *mp)
         Sel.x = mp->Mouse.x / dx;
         Sel.y = 7 - mp->Mouse.y / dy;
         cb->TranslateCoord (&Sel);
+        cb->EditSquare = Sel;   // Main Loop places it
         if (mp->Selected <= pPawn)
-          Board [Sel.x][Sel.y] = PieceFrom (mp->Selected, false);
+          cb->EditPiece = PieceFrom (mp->Selected, false);
         else
-          Board [Sel.x][Sel.y] = PieceFrom (mp->Selected - pPawn, true);
+          cb->EditPiece = PieceFrom (mp->Selected - pPawn, true);
+        AnalyseAbort = true;
         cb->Move [0][0] = {-1, -1};
         cb->Move [1][0] = {-1, -1};
+        cb->HintsCount = 0;
         cb->Invalidate (true);
         cb->MoveComplete = true;
       }
@@ -1402,8 +5844,6 @@ _FormMain::_FormMain (char *Title): _Form (Title, {100, 100, FormSize.x, FormSiz
     // Make the Main Form
     ColourBG [0] = cOrange;
     ColourBG [1] = ColourAdjust (cOrange, 80);
-    Logs = (char *) malloc (LogsSize);
-    sLogs = Logs;
     Container->FontSet (NULL, 14);//, fsNoGrayscale);Ubuntu-R.ttf
     Container->Bitmap = BitmapLoadResource (Window, "Chess2.bmp");
     y = 0;
@@ -1441,9 +5881,8 @@ _FormMain::_FormMain (char *Title): _Form (Title, {100, 100, FormSize.x, FormSiz
     mPieces->EnabledSet (false);
     x += BoardWidth;
     //
-    lLogs = new _Label (Container, {x + 4, Toolbar->Rect.Height, -8, -20}, NULL, aLeft, bNone);
+    lLogs = new _LogView (Container, {x + 4, Toolbar->Rect.Height, -8, -20});
     lLogs->RectLock = rlLeft | rlBottom;
-    lLogs->AlignVert = aBottom;
     lLogs->FontSet (NULL, 14);//, fsBold);
     y += cBoard->Rect.Height;
     //
@@ -1453,12 +5892,12 @@ _FormMain::_FormMain (char *Title): _Form (Title, {100, 100, FormSize.x, FormSiz
     Wait = new _Wait (lLogs, {0, 0, 0, 0});
     Wait->VisibleSet (false);
     //
-    Menu = new _MenuPopup (Container, {0, 0, 0, 0}, "\e7Reload\t\e8Save\t\e8Save Log", ActionMenu);
+    Menu = new _MenuPopup (Container, {0, 0, 0, 0}, "\e7Reload\t\e8Save\t\e8Save Log\t\e2Analyse\t\e2Review Game\t\e2Solve Mate\t\e8Save Trace\t\e8Add to Database\t\e7Import to Database\t\e2Database Moves\t\e8Save PGN\t\e7Import PGN\t\e1Redo", ActionMenu);
   }
 
 _FormMain::~_FormMain ()
   {
-    free (Logs);
+    LogClear ();
   }
 
 
@@ -1468,12 +5907,219 @@ _FormMain::~_FormMain ()
 //
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-int main_ (int argc, char *argv [])
+int ProgressShownTime;
+int AnalyseShownSeq = -1;
+
+// Show the latest Analysis results in lPCStats & as arrows on the Board
+void AnalyseShow (void)
+  {
+    _AnalyseSnapshot Snap;
+    char St [600], *s;
+    int i;
+    //
+    if (!AnalyseRead (&Snap))
+      return;
+    AnalyseShownSeq = Snap.Seq;
+    s = St;
+    RootMovesToStr (&s, &Snap, AnalyseLines);
+    if (Snap.Perf [pcCycles] >= 0 && Snap.Depth)
+      {
+        StrCat (&s, "   \a0");
+        PerfToStr (&s, Snap.Perf);
+      }
+    *s = 0;
+    fMain->lPCStats->TextSet (St);
+    fMain->cBoard->HintsCount = 0;
+    if (Snap.Depth)
+      fMain->cBoard->HintsCount = Min (Min (AnalyseLines, Snap.Count), SIZEARRAY (Snap.Best));
+    for (i = 0; i < fMain->cBoard->HintsCount; i++)
+      {
+        fMain->cBoard->Hints [i][0] = Snap.Best [i].From;
+        fMain->cBoard->Hints [i][1] = Snap.Best [i].To;
+      }
+    fMain->cBoard->Invalidate (true);
+  }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Review Game: rewind, then analyse each position before replaying its move, noting it in the Log.
+// Journalling is off meanwhile: the game ends where it started, so that's one 'J' record at the end
+
+const int ReviewInaccuracy = 400;   // Score lost for ?!
+const int ReviewMistake = 900;   // ?
+const int ReviewBlunder = 2000;   // ??
+
+int ReviewPly = -1;   // Ply being analysed. -1 = not reviewing
+int ReviewPlies;
+_Coord ReviewMoves [SIZEARRAY (UndoStack)][2];
+int ReviewFound [3];   // Inaccuracies, Mistakes, Blunders
+char ReviewNote [64];
+
+void ReviewNext (void)
+  {
+    char St [80], *s;
+    //
+    s = St;
+    StrCat (&s, "Reviewing move ");
+    IntToStr (&s, ReviewPly / 2 + 1);
+    StrCat (&s, " of ");
+    IntToStr (&s, (ReviewPlies + 1) / 2);
+    *s = 0;
+    fMain->lPCStats->TextSet (St);
+    AnalyseStart (Max (DepthPlay - 1, 1), false, ReviewMoves [ReviewPly]);   // A fixed, smaller budget per position. Grading needs the move played exactly
+  }
+
+// Rewind the game & start analysing its first position
+void ReviewStart (void)
+  {
+    int i;
+    //
+    if (UndoStackSize == 0)
+      {
+        fMain->lMessage->TextSet ("No moves to Review");
+        fMain->lMessage->VisibleSet (true);
+        return;
+      }
+    ReviewPlies = UndoStackSize;
+    for (i = 0; i < ReviewPlies; i++)
+      {
+        ReviewMoves [i][0] = UndoStack [i].From;
+        ReviewMoves [i][1] = UndoStack [i].To;
+      }
+    JournalReplaying = true;
+    GameJump (0);
+    memset (ReviewFound, 0, sizeof (ReviewFound));
+    MoveForbidenFrom = MoveForbidenTo = {-1, -1};
+    fMain->cBoard->Move [0][0].x = -1;
+    fMain->cBoard->Move [1][0].x = -1;
+    fMain->lMessage->VisibleSet (false);
+    fMain->Toolbar->EnabledSet (false);
+    fMain->Wait->VisibleSet (true);
+    ReviewPly = 0;
+    Refresh = true;
+    ReviewNext ();
+  }
+
+// Analysis of ReviewPly is done: grade the move played, replay it & go on
+void ReviewStep (void)
+  {
+    _Coord *Played;
+    _RootMove *Best;
+    char *s;
+    int i, Lost, Grade;
+    //
+    Played = ReviewMoves [ReviewPly];
+    Best = &RootMoves [0];
+    Lost = 0;
+    for (i = 0; i < RootMovesCount; i++)
+      if (RootMoves [i].From.x == Played [0].x && RootMoves [i].From.y == Played [0].y &&
+          RootMoves [i].To.x == Played [1].x && RootMoves [i].To.y == Played [1].y)
+        Lost = Best->Score - RootMoves [i].Score;
+    Grade = -1;
+    if (Lost >= ReviewBlunder)
+      Grade = 2;
+    else if (Lost >= ReviewMistake)
+      Grade = 1;
+    else if (Lost >= ReviewInaccuracy)
+      Grade = 0;
+    if (Grade >= 0)
+      {
+        ReviewFound [Grade]++;
+        s = ReviewNote;
+        StrCat (&s, " \a1");
+        StrCat (&s, Grade == 2 ? "??" : Grade == 1 ? "?" : "?!");
+        StrCat (&s, ' ');
+        CoordToStr (&s, Best->From);
+        CoordToStr (&s, Best->To);
+        StrCat (&s, ' ');
+        IntToStrDecimals (&s, -Lost, 3);
+        StrCat (&s, AnalyseWhite ? "\a7" : "\a0");   // Back to the mover's colour
+        *s = 0;
+        LogNoteSet (UndoStack [ReviewPly].Log, ReviewNote);
+      }
+    RedoPiece_ ();
+    Refresh = true;
+    if (++ReviewPly < ReviewPlies)
+      ReviewNext ();
+    else   // All done
+      {
+        ReviewPly = -1;
+        JournalReplaying = false;
+        JournalJump (UndoStackSize);
+        fMain->Toolbar->EnabledSet (true);
+        fMain->Wait->VisibleSet (false);
+        s = ReviewNote;
+        StrCat (&s, "Review: ");
+        IntToStr (&s, ReviewFound [2]);
+        StrCat (&s, " Blunders, ");
+        IntToStr (&s, ReviewFound [1]);
+        StrCat (&s, " Mistakes, ");
+        IntToStr (&s, ReviewFound [0]);
+        StrCat (&s, " Inaccuracies");
+        *s = 0;
+        fMain->lPCStats->TextSet (ReviewNote);
+      }
+  }
+
+// Show how the PC's search is going, with the best move so far as an arrow
+void PlayProgressShow (void)
   {
     char St [200], *s;
+    _Coord From, To;
+    _ChessBoard *cb;
+    //
+    cb = fMain->cBoard;
+    s = St;
+    StrCat (&s, PlayThreadWhite ? "\a7" : "\a0");
+    StrCat (&s, "Thinking: ");
+    SearchRateToStr (&s, MovesConsidered, ClockMS () - SearchStartTime);
+    From = BestA [0];   // The engine may be writing these: check them against the Board
+    To = BestB [0];
+    if (OnBoard (From.x, From.y) && OnBoard (To.x, To.y))
+      if (Piece (BoardView [From.x][From.y]) != pEmpty && PieceWhite (BoardView [From.x][From.y]) == PlayThreadWhite)
+        {
+          StrCat (&s, "   Best so far ");
+          CoordToStr (&s, From);
+          StrCat (&s, ' ');
+          CoordToStr (&s, To);
+          if (cb->HintsCount != 1 || cb->Hints [0][0].x != From.x || cb->Hints [0][0].y != From.y || cb->Hints [0][1].x != To.x || cb->Hints [0][1].y != To.y)
+            {
+              cb->Hints [0][0] = From;
+              cb->Hints [0][1] = To;
+              cb->HintsCount = 1;
+              cb->Invalidate (true);
+            }
+        }
+    *s = 0;
+    fMain->lPCStats->TextSet (St);
+  }
+
+void MateProgressShow (void)
+  {
+    char St [120], *s;
+    //
+    s = St;
+    StrCat (&s, "Looking for Mate in ");
+    IntToStr (&s, MateMoves);
+    StrCat (&s, ": ");
+    IntToStr (&s, MateNodesUsed, DigitsCommas);
+    StrCat (&s, " positions of ");
+    IntToStr (&s, MateNodesMax, DigitsCommas);
+    *s = 0;
+    fMain->lPCStats->TextSet (St);
+  }
+
+int main_ (int argc, char *argv [])
+  {
+    char St [400], *s;
     _Bitmap *Icon;
     int Col;
+    int64_t Start;
+    bool Quit;
     //
+    if (argc >= 2 && strcmp (argv [1], "bench") == 0)   // No GUI, just a search speed test
+      return Bench (argc >= 3 ? atoi (argv [2]) : 3);
+    if (argc >= 2 && strcmp (argv [1], "bench-eval") == 0)   // Batch evaluation speed test
+      return BenchEval (argc >= 3 ? atoi (argv [2]) : 1000000, argc >= 4 ? atoi (argv [3]) : 3);
     DebugAddS ("===========Start Chess", Revision);
     ResourcePathSet (argv [0]);
     chdir (ResourcePath);
@@ -1484,18 +6130,25 @@ int main_ (int argc, char *argv [])
     Restart = true;
     PCPlays = true;
     PCPlay = Analyse = false;
-    UndoStackSize = 0;
+    UndoClear ();
     s = St;   // Build the form Title
     StrCat (&s, "Stewy's Chess Programme - ");
     StrCat (&s, Revision);
     *s = 0;
     if (FontsRead () == 0)
-      DebugAdd ("**** NO CHESS FONTS");
+      DebugError ("**** NO CHESS FONTS", NULL);
     fMain = new _FormMain (St);
     Icon = BitmapLoad (fMain->Window, "Icon.bmp");
     WindowSetIcon (fMain->Window, Icon);
     BitmapDestroy (Icon);
     SettingsLoad ();
+    CacheLoad ();
+    if (JournalRecover ())   // Carry on with the last game
+      {
+        Restart = false;
+        fMain->cBoard->Move [0][0].x = -1;
+        fMain->cBoard->Move [1][0].x = -1;
+      }
     if (Colours [0] >= 0)
       fMain->cBoard->Colours [0] = Colours [0];
     if (Colours [1] >= 0)
@@ -1504,6 +6157,7 @@ int main_ (int argc, char *argv [])
       fMain->ColourBG [0] = Colours [2];
     if (Colours [3] >= 0)
       fMain->ColourBG [1] = Colours [3];
+    DebugConsole = false;   // Started. Widgets' chatter only goes to the trace now
     // Main Loop
     while (!Exit)
       {
@@ -1512,34 +6166,37 @@ int main_ (int argc, char *argv [])
         //  cBoard->Invalidate (true);
         fMain->Container->EnabledSet (!FileSelectActive);
         fMain->bUndo->EnabledSet (UndoStackSize > 0);
-        if (fMain->sLogs - fMain->Logs + 50 > fMain->LogsSize)   // the problem of c strings is ...
-          fMain->sLogs = fMain->Logs;
-        if (Restart)
+        if (Restart && !EngineBusy ())
           {
+            _TraceSpan Span ("Restart");
             Restart = false;
             BoardInit ();
             //BoardScoreWhite = 0;
             fMain->cBoard->Move [0][0].x = -1;
             fMain->cBoard->Move [1][0].x = -1;
+            fMain->cBoard->HintsCount = 0;
             fMain->Graveyard [0][0] = pEmpty;
             fMain->Graveyard [1][0] = pEmpty;
             GraveyardUpdate ();
-            fMain->sLogs = fMain->Logs;
+            LogClear ();
             fMain->lMessage->VisibleSet (false);
             fMain->lMessage->TextSet (NULL);
             fMain->lPCStats->TextSet (NULL);
             Refresh = true;
-            UndoStackSize = 0;
-            if (!PlayerWhite)
+            UndoClear ();
+            JournalNewGame ();
+            if (fMain->bEdit->Down)   // Analyse the new Board instead
+              Analyse = true;
+            else if (!PlayerWhite)
               if (PCPlays)
                 PCPlay = true;
           }
-        else if (Load)
+        else if (Load && !EngineBusy ())
           {
             Load = false;
             FileSelect ("Load Game", ".chess", false, GameLoad);
           }
-        else if (Save)
+        else if (Save && !EngineBusy ())
           {
             Save = false;
             FileSelect ("Save Game", ".chess", true, GameSave);
@@ -1549,8 +6206,29 @@ int main_ (int argc, char *argv [])
             SaveLog = false;
             FileSelect ("Save Log", ".log", true, LogSave);
           }
+        else if (SaveTrace)
+          {
+            SaveTrace = false;
+            FileSelect ("Save Trace", ".json", true, TraceSave);
+          }
+        else if (SavePGN && !EngineBusy ())
+          {
+            SavePGN = false;
+            FileSelect ("Save PGN", ".pgn", true, PgnSave);
+          }
+        else if (ImportPGN && !EngineBusy ())
+          {
+            ImportPGN = false;
+            FileSelect ("Import PGN to Database", ".pgn", false, PgnImport);
+          }
+        else if (DatabaseImport && !EngineBusy ())
+          {
+            DatabaseImport = false;
+            FileSelect ("Import to Database", ".chess", false, DbImport);
+          }
         else if (Undo)
           {
+            _TraceSpan Span ("Undo");
             Undo = false;
             if (UndoStackSize)
               UnmovePiece_();   // so undo a move
@@ -1558,12 +6236,29 @@ int main_ (int argc, char *argv [])
             fMain->cBoard->Move [1][0].x = -1;
             fMain->lMessage->VisibleSet (false);
             fMain->lMessage->TextSet (NULL);
-            if (MoveID == 0)   // starting again
-              Restart = true;
             Refresh = true;
           }
+        else if (Redo && !EngineBusy ())
+          {
+            _TraceSpan Span ("Redo");
+            Redo = false;
+            RedoPiece_ ();
+            fMain->cBoard->Move [0][0].x = -1;
+            fMain->cBoard->Move [1][0].x = -1;
+            fMain->lMessage->VisibleSet (false);
+            Refresh = true;
+          }
+        else if (LogClicked >= 0 && !EngineBusy ())
+          {
+            _TraceSpan Span ("Jump");
+            if (!fMain->bEdit->Down && ReviewPly < 0)
+              GameJump (LogItemPly (LogClicked));
+            LogClicked = -1;
+            fMain->lMessage->VisibleSet (false);
+          }
         else if (PlayThreadFinished)
           {
+            _TraceSpan Span ("Play Finished");
             PlayThreadFinished = false;
             fMain->Toolbar->EnabledSet (true);
             // Build / show stats message
@@ -1580,6 +6275,18 @@ int main_ (int argc, char *argv [])
             IntToStrDecimals (&s, BoardScore (PlayThreadWhite), 3);
             StrCat (&s, ", ");
             IntToStrDecimals (&s, PlayThreadScore, 3);
+            if (PlayThreadCached)
+              StrCat (&s, "  (Cached)");
+            else
+              {
+                CacheStore (PlayThreadScore, BestA [0], BestB [0]);
+                if (PerfEnabled)
+                  {
+                    StrCat (&s, "   ");
+                    PerfToStr (&s, PlayThreadPerf.Count);
+                  }
+              }
+            PlayThreadCached = false;
             *s = 0;
             fMain->lPCStats->TextSet (St);
             // Process move
@@ -1607,32 +6314,149 @@ int main_ (int argc, char *argv [])
               }
             fMain->Wait->VisibleSet (false);
           }
-        else if (PCPlay && !PlayThreadStarted)
+        else if (AnalyseThreadFinished)
+          {
+            _TraceSpan Span ("Analyse Finished");
+            AnalyseThreadFinished = false;
+            if (ReviewPly >= 0)
+              ReviewStep ();
+            else
+              {
+                fMain->Toolbar->EnabledSet (true);
+                fMain->Wait->VisibleSet (false);
+                if (!AnalyseAbort)   // otherwise it's for a Board that's gone
+                  AnalyseShow ();
+              }
+          }
+        else if (DatabaseAdd && !EngineBusy ())
+          {
+            _TraceSpan Span ("Database Add");
+            DatabaseAdd = false;
+            s = St;
+            if (DbAddGame ())
+              {
+                StrCat (&s, "Game added. Database: ");
+                IntToStr (&s, DbGames, DigitsCommas);
+                StrCat (&s, " games");
+              }
+            else
+              StrCat (&s, "\ab\a1Couldn't add the game to the Database\ab");
+            *s = 0;
+            fMain->lPCStats->TextSet (St);
+          }
+        else if (DatabaseShow && !EngineBusy ())
+          {
+            _TraceSpan Span ("Database Moves");
+            DatabaseShow = false;
+            DbShow ();
+          }
+        else if (Review && !EngineBusy ())
+          {
+            _TraceSpan Span ("Review Start");
+            Review = false;
+            ReviewStart ();
+          }
+        else if (Mate && !EngineBusy ())
+          {
+            _TraceSpan Span ("Mate Start");
+            Mate = false;
+            AnalyseResume = false;   // Leave the solution on show. The next edit analyses again
+            fMain->Toolbar->EnabledSet (false);
+            fMain->cBoard->HintsCount = 0;
+            MateStart ();
+            fMain->Wait->ColourText = (MoveID & 1) ? cBlack : cWhite;
+            fMain->Wait->VisibleSet (true);
+          }
+        else if (PgnThreadFinished)
+          {
+            _TraceSpan Span ("PGN Import Finished");
+            PgnThreadFinished = false;
+            fMain->Toolbar->EnabledSet (true);
+            fMain->lPCStats->TextSet (PgnStats);
+            Refresh = true;
+          }
+        else if (MateThreadFinished)
+          {
+            _TraceSpan Span ("Mate Finished");
+            MateThreadFinished = false;
+            fMain->Toolbar->EnabledSet (true);
+            fMain->Wait->VisibleSet (false);
+            s = St;
+            MateToStr (&s);
+            *s = 0;
+            fMain->lPCStats->TextSet (St);
+            if (MateLineLength)
+              {
+                fMain->cBoard->Hints [0][0] = MateLine [0][0];
+                fMain->cBoard->Hints [0][1] = MateLine [0][1];
+                fMain->cBoard->HintsCount = 1;
+              }
+            fMain->cBoard->Invalidate (true);
+          }
+        else if (PCPlay && !EngineBusy ())
           {
+            _TraceSpan Span ("Play Start");
             PCPlay = false;
             bool Player = (MoveID & 1) ^ 1;   // Play for whoever's turn it is
             fMain->Toolbar->EnabledSet (false);
             InCheck (Player);   // Mark King if in check
             if (CheckRepeat ())
               fMain->lPCStats->TextSet ("\ab\a1Avoiding Loop\ab");
-            StartThread (PlayThread, (void *) Player);
-            fMain->Wait->ColourText = Player ? cWhite : cBlack;
-            fMain->Wait->VisibleSet (true);
+            if (CacheFind ())   // Searched before
+              {
+                PlayThreadWhite = Player;
+                PlayThreadTime = 0;
+                MovesConsidered = 0;
+                PlayThreadCached = true;
+                PlayThreadFinished = true;
+              }
+            else
+              {
+                memcpy (BoardView, Board, sizeof (BoardView));
+                BestA [0] = BestB [0] = {-1, -1};   // So progress shows no stale best move
+                PlayThreadWhite = Player;
+                SearchStartTime = ClockMS ();
+                PlayThreadStarted = true;
+                StartThread (PlayThread, (void *) Player);
+                fMain->Wait->ColourText = Player ? cWhite : cBlack;
+                fMain->Wait->VisibleSet (true);
+              }
           }
-        else if (Analyse)
+        else if ((Analyse || (AnalyseResume && fMain->bEdit->Down)) && !EngineBusy () && !FileSelectActive && !fMain->cBoard->MoveComplete)
           {
-            Analyse = false;
+            _TraceSpan Span ("Analyse Start");
+            Analyse = AnalyseResume = false;
             s = St;
             StrCat (&s, "White Board Score ");
             IntToStrDecimals (&s, BoardScore (true), 3);
             *s = 0;
             fMain->lPCStats->TextSet (St);
+            fMain->cBoard->HintsCount = 0;
+            if (AnalyseLines > 0)   // Find the best moves too
+              if (fMain->bEdit->Down)   // keep going in the background until the Board changes
+                AnalyseStart (DepthPlay, true);
+              else
+                {
+                  fMain->Toolbar->EnabledSet (false);
+                  AnalyseStart (DepthPlay, false);
+                  fMain->Wait->ColourText = AnalyseWhite ? cWhite : cBlack;
+                  fMain->Wait->VisibleSet (true);
+                }
+            fMain->cBoard->Invalidate (true);
           }
-        else if (fMain->cBoard->MoveComplete)
+        else if (fMain->cBoard->MoveComplete && !EngineBusy ())
           {
+            _TraceSpan Span ("Move");
             fMain->cBoard->MoveStart = false;
             fMain->cBoard->MoveComplete = false;
             fMain->lMessage->VisibleSet (false);
+            if (fMain->cBoard->EditSquare.x >= 0)   // New piece from the Pieces menu
+              {
+                Board [fMain->cBoard->EditSquare.x][fMain->cBoard->EditSquare.y] = fMain->cBoard->EditPiece;
+                fMain->cBoard->EditSquare.x = -1;
+                Analyse = true;
+                JournalNewGame ();   // an edited Board starts again
+              }
             if (fMain->bEdit->Down)   // Editing
               {
                 for (Col = 0; Col < 2; Col++)
@@ -1640,8 +6464,10 @@ int main_ (int argc, char *argv [])
                     {
                       Board [fMain->cBoard->Move [Col][1].x][fMain->cBoard->Move [Col][1].y] = Board [fMain->cBoard->Move [Col][0].x][fMain->cBoard->Move [Col][0].y];
                       Board [fMain->cBoard->Move [Col][0].x][fMain->cBoard->Move [Col][0].y] = pEmpty;
-                      Analyse = true;
+                      fMain->cBoard->HintsCount = 0;
+                      JournalNewGame ();
                     }
+                Analyse = true;   // The drop stopped Analysis: start again, moved or not
               }
             else
               {
@@ -1656,18 +6482,20 @@ int main_ (int argc, char *argv [])
                   {
                     if (MoveValid (fMain->cBoard->Move [fMain->cBoard->MoveWhite][0], fMain->cBoard->Move [fMain->cBoard->MoveWhite][1]))
                       {
-                        MovePiece_ (fMain->cBoard->Move [fMain->cBoard->MoveWhite][0], fMain->cBoard->Move [fMain->cBoard->MoveWhite][1]);
-                        if (InCheck (MoveID & 1))   // You moved into / stayed in Check PlayerWhite
+                        if (!MoveSafe (fMain->cBoard->Move [fMain->cBoard->MoveWhite][0], fMain->cBoard->Move [fMain->cBoard->MoveWhite][1]))   // You'd move into / stay in Check
                           {
-                            UnmovePiece_ ();   // undo move
                             fMain->lMessage->TextSet ("Save The King");
                             fMain->lMessage->VisibleSet (true);
                             Beep ();
                             PCPlayForever = false;
                           }
-                        else if ((MoveID & 1) == PlayerWhite)   // Computer's turn
-                          if (PCPlays)
-                            PCPlay = true;
+                        else
+                          {
+                            MovePiece_ (fMain->cBoard->Move [fMain->cBoard->MoveWhite][0], fMain->cBoard->Move [fMain->cBoard->MoveWhite][1]);
+                            if ((MoveID & 1) == PlayerWhite)   // Computer's turn
+                              if (PCPlays)
+                                PCPlay = true;
+                          }
                       }
                     else
                       {
@@ -1682,8 +6510,20 @@ int main_ (int argc, char *argv [])
             Refresh = true;
           }
         else
-          if (PCPlayForever && !PlayThreadStarted)
+          if (PCPlayForever && !EngineBusy ())
             PCPlay = true;
+        if ((PlayThreadStarted || MateThreadStarted || PgnThreadStarted || (AnalyseThreadStarted && !AnalyseAbort)) && ClockMS () - ProgressShownTime >= 250)   // Show progress, but not too often
+          {
+            ProgressShownTime = ClockMS ();
+            if (PlayThreadStarted)
+              PlayProgressShow ();
+            else if (MateThreadStarted)
+              MateProgressShow ();
+            else if (PgnThreadStarted)
+              PgnProgressShow ();
+            else if (AnalyseSnap.Seq != AnalyseShownSeq && ReviewPly < 0)
+              AnalyseShow ();
+          }
         if (fMain->ColourBG [0] != fMain->Container->Colour || fMain->ColourBG [1] != fMain->Container->ColourGrad)
           {
             fMain->Container->Colour = fMain->ColourBG [0];
@@ -1696,16 +6536,33 @@ int main_ (int argc, char *argv [])
           }
         if (Refresh)
           {
+            _TraceSpan Span ("Refresh");
             Refresh = false;
+            if (!EngineBusy ())
+              ControlledUpdate ();
             fMain->cBoard->Invalidate (true);
-            *fMain->sLogs = 0;
-            fMain->lLogs->TextSet (fMain->Logs);
+            fMain->lLogs->Update ();
             GraveyardUpdate ();
           }
-        if (FormsUpdate ())
+        JournalSync (false);
+        CacheSync ();
+        Start = TraceNS ();
+        Quit = FormsUpdate ();
+        if (TraceNS () - Start >= TraceIdleNS)   // Skip the idle polls, they'd flood the ring
+          TraceAdd ("FormsUpdate", Start, TraceNS () - Start, 0);
+        if (Quit)
           break;
       }
+    AnalyseAbort = MateAbort = PgnAbort = true;   // Let any Analysis finish with the Board, and the Database files
+    while (AnalyseThreadStarted || MateThreadStarted || PgnThreadStarted)
+      usleep (1000);
+    LargeFree (MateNodes, MateNodesMax * sizeof (_MateNode));
     SettingsSave ();   // and save settings there
+    CacheSave ();
+    JournalSync (true);
+    if (Journal)
+      fclose (Journal);
+    free (Cache);
     while (FormList)
       delete (FormList);
     DirFree (Fonts);